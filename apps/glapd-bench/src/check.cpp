@@ -0,0 +1,542 @@
+#include "check.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <bowtie.h>
+#include <packed_sequence.h>
+#include <par.h>
+#include <thread_pool.h>
+#include <unzip.h>
+#include <workspace_zip.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr PrimerType allPrimerTypes[] = { PrimerType::inner, PrimerType::outer, PrimerType::loop };
+constexpr int mis_c = 1;
+constexpr int mis_s = 2;
+constexpr size_t numRandomCandidates = 1000; // per primer type
+
+// The lines of -common.txt and -specific.txt, by PrimerType
+struct HitTables {
+    std::array<std::vector<std::string>, numPrimerTypes> common;
+    std::array<std::vector<std::string>, numPrimerTypes> specific;
+};
+
+struct CheckInputs {
+    std::string refPath;
+    std::string refSequence;
+    PrimerCandidates candidates;
+    std::vector<std::string> targetGenomeNames;
+    std::vector<std::string> backgroundGenomeNames;
+    std::string indexPath;
+    std::vector<std::string> splitIndexPaths;
+};
+
+// One configuration of alignPrimerCandidates
+struct CheckRun {
+    bool left = false; // otherwise with an explicit background list
+    std::vector<std::string> indexPaths;
+    bool single_pass = false;
+    int threads = 1;
+};
+
+std::string readFile(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open file: " + path.string());
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+std::vector<std::string> readLines(const fs::path& path) {
+    std::istringstream in(readFile(path));
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(in, line))
+        lines.push_back(line);
+    return lines;
+}
+
+std::string readFastaSequence(const fs::path& path) {
+    std::string sequence;
+    for (const std::string& line : readLines(path)) {
+        if (!line.empty() && line[0] != '>')
+            sequence += line;
+    }
+    return sequence;
+}
+
+std::string buildIndex(const fs::path& fastaPath, const fs::path& indexPath) {
+    const std::string fastaPathStr = fastaPath.string();
+    const std::string indexPathStr = indexPath.string();
+    const char* args[] = {
+        "bowtie-build",
+        "--quiet",
+        fastaPathStr.c_str(),
+        indexPathStr.c_str(),
+    };
+    if (bowtie_build(std::size(args), args) != 0)
+        throw std::runtime_error("bowtie-build failed for " + fastaPathStr);
+    return indexPathStr;
+}
+
+// Builds two indexes with every other genome of the dataset each, so hits come from several shards
+std::vector<std::string> buildSplitIndex(const SyntheticDataset& dataset, const fs::path& dir) {
+    std::array<std::ofstream, 2> outs = {
+        std::ofstream(dir / "split0.fa"),
+        std::ofstream(dir / "split1.fa"),
+    };
+
+    size_t numRecords = 0;
+    for (const std::string& line : readLines(dataset.indexFastaPath)) {
+        if (!line.empty() && line[0] == '>')
+            numRecords++;
+        outs[(numRecords - 1) % 2] << line << '\n';
+    }
+    for (std::ofstream& out : outs)
+        out.close();
+
+    return {
+        buildIndex(dir / "split0.fa", dir / "split0"),
+        buildIndex(dir / "split1.fa", dir / "split1"),
+    };
+}
+
+// Random primers on the reference, plus the primers that parpl aligns as one read: identical primers, primers at the
+// same position with other strand flags, and pairs of primers in inverted repeats, which are reverse complements of
+// each other up to mutations
+std::vector<PrimerInfo> generateCandidates(const SyntheticDataset& dataset, size_t refSize, std::mt19937& rng) {
+    std::uniform_int_distribution<int> len(18, 25);
+    std::uniform_int_distribution<int> bit(0, 1);
+
+    std::vector<PrimerInfo> candidates;
+    for (size_t i = 0; i < numRandomCandidates; i++) {
+        const int l = len(rng);
+        std::uniform_int_distribution<int> pos(0, static_cast<int>(refSize) - l);
+        candidates.push_back({ pos(rng), l, bit(rng), bit(rng) });
+    }
+
+    for (size_t i = 0; i < numRandomCandidates / 10; i++) {
+        PrimerInfo candidate = candidates[i];
+        candidates.push_back(candidate);
+        candidate.plus = !candidate.plus;
+        candidates.push_back(candidate);
+    }
+
+    for (const InvertedRepeat& repeat : dataset.invertedRepeats) {
+        const int l = len(rng);
+        std::uniform_int_distribution<int> offset(0, static_cast<int>(repeat.size) - l);
+        const int o = offset(rng);
+        candidates.push_back({ static_cast<int>(repeat.src) + o, l, bit(rng), bit(rng) });
+        candidates.push_back({ static_cast<int>(repeat.dst + repeat.size) - o - l, l, bit(rng), bit(rng) });
+    }
+
+    std::shuffle(candidates.begin(), candidates.end(), rng);
+    return candidates;
+}
+
+std::vector<int> getMutationPositions(const std::string& field) {
+    std::vector<int> positions;
+    std::istringstream ss(field);
+    std::string mismatch;
+    while (std::getline(ss, mismatch, ','))
+        positions.push_back(std::stoi(mismatch));
+    return positions;
+}
+
+// parpl as it was before hits were streamed, deduplicated and split across threads: bowtie writes all hits of a
+// primer type to a file, which is classified line by line. Unlike the original, the --specific list is loaded instead
+// of discarded.
+HitTables alignBaseline(const CheckInputs& inputs, bool left, const fs::path& dir) {
+    std::unordered_map<std::string, unsigned> targetGenomeNameToIndex;
+    for (const std::string& name : inputs.targetGenomeNames)
+        targetGenomeNameToIndex.emplace(name, targetGenomeNameToIndex.size());
+
+    std::unordered_map<std::string, unsigned> backgroundGenomeNameToIndex;
+    if (!left) {
+        for (const std::string& name : inputs.backgroundGenomeNames)
+            backgroundGenomeNameToIndex.emplace(name, backgroundGenomeNameToIndex.size());
+    }
+
+    HitTables tables;
+    for (const PrimerType primerType : allPrimerTypes) {
+        const size_t t = static_cast<size_t>(primerType);
+        const std::string fastaPath = (dir / "baseline.fa").string();
+        const std::string bowtieOutputPath = (dir / "baseline.bowtie").string();
+
+        {
+            std::ofstream out(fastaPath);
+            for (const PrimerInfo& candidate : inputs.candidates[t]) {
+                out << '>' << candidate.pos << '-' << candidate.len << '-' << candidate.plus << '-' << candidate.minus
+                    << '\n' << inputs.refSequence.substr(candidate.pos, candidate.len) << '\n';
+            }
+        }
+
+        const std::string v = std::to_string(mis_s);
+        const char* args[] = {
+            "bowtie",
+            "-f",
+            "--suppress", "5,6,7",
+            "-v", v.c_str(),
+            "-a", inputs.indexPath.c_str(),
+            fastaPath.c_str(),
+            bowtieOutputPath.c_str(),
+        };
+        if (bowtie(std::size(args), args) != 0)
+            throw std::runtime_error("bowtie failed");
+
+        for (const std::string& line : readLines(bowtieOutputPath)) {
+            std::istringstream fields(line);
+            std::string primerName, strand, genomeId, refOffset, mismatchField;
+            std::getline(fields, primerName, '\t');
+            std::getline(fields, strand, '\t');
+            std::getline(fields, genomeId, '\t');
+            std::getline(fields, refOffset, '\t');
+            std::getline(fields, mismatchField, '\t');
+
+            int pos, len, plus, minus;
+            if (std::sscanf(primerName.c_str(), "%d-%d-%d-%d", &pos, &len, &plus, &minus) != 4)
+                continue;
+
+            const std::vector<int> mutationPositions = getMutationPositions(mismatchField);
+            bool begin = false, stop = false;
+            for (const int mut : mutationPositions) {
+                if (mut < 5)
+                    begin = true;
+                if (mut >= len - 5)
+                    stop = true;
+            }
+
+            int strandMatchPlus = 0, strandMatchMinus = 0;
+            if (primerType == PrimerType::inner) {
+                if (plus && !begin) (strand == "+" ? strandMatchPlus : strandMatchMinus) = 1;
+                if (minus && !stop) (strand == "+" ? strandMatchMinus : strandMatchPlus) = 1;
+            } else {
+                if (plus && !stop) (strand == "+" ? strandMatchPlus : strandMatchMinus) = 1;
+                if (minus && !begin) (strand == "+" ? strandMatchMinus : strandMatchPlus) = 1;
+            }
+
+            if (strandMatchPlus + strandMatchMinus == 0)
+                continue;
+
+            const auto formatLine = [&](unsigned genomeIndex) {
+                return std::to_string(pos) + '\t' + std::to_string(len) + '\t' + std::to_string(genomeIndex) + '\t'
+                    + refOffset + '\t' + std::to_string(strandMatchPlus) + '\t' + std::to_string(strandMatchMinus);
+            };
+
+            if (const auto it = targetGenomeNameToIndex.find(genomeId); it != targetGenomeNameToIndex.end()) {
+                if (static_cast<int>(mutationPositions.size()) <= mis_c)
+                    tables.common[t].push_back(formatLine(it->second));
+                continue;
+            }
+
+            if (primerType == PrimerType::loop)
+                continue;
+
+            if (const auto it = backgroundGenomeNameToIndex.find(genomeId); it != backgroundGenomeNameToIndex.end()) {
+                tables.specific[t].push_back(formatLine(it->second));
+            } else if (left) {
+                const unsigned backgroundGenomeIndex = backgroundGenomeNameToIndex.size();
+                backgroundGenomeNameToIndex.emplace(genomeId, backgroundGenomeIndex);
+                tables.specific[t].push_back(formatLine(backgroundGenomeIndex));
+            }
+        }
+    }
+
+    fs::remove(dir / "baseline.fa");
+    fs::remove(dir / "baseline.bowtie");
+    return tables;
+}
+
+// Aligns like portable-glapd and reads back the files written by writeHitTables
+HitTables alignCurrent(const CheckInputs& inputs, const CheckRun& run, const fs::path& dir) {
+    const PackedSequence refSequence = PackedSequence::loadFasta(inputs.refPath);
+
+    AlignOptions options;
+    options.refSequence = &refSequence;
+    for (const std::string& indexPath : run.indexPaths)
+        options.indexes.push_back(BowtieIndex::open(indexPath));
+    options.primerTypes = { std::begin(allPrimerTypes), std::end(allPrimerTypes) };
+    options.targetGenomeNames = inputs.targetGenomeNames;
+    if (!run.left)
+        options.backgroundGenomeNames = inputs.backgroundGenomeNames;
+    options.left = run.left;
+    options.mis_c = mis_c;
+    options.mis_s = mis_s;
+    options.threads = run.threads;
+    options.single_pass = run.single_pass;
+    options.tempDir = dir.string();
+
+    const AlignResult result = alignPrimerCandidates(inputs.candidates, options);
+
+    for (const PrimerType primerType : allPrimerTypes)
+        fs::create_directories(dir / toString(primerType));
+    writeHitTables(result, dir.string(), "NAME");
+
+    HitTables tables;
+    for (const PrimerType primerType : allPrimerTypes) {
+        const size_t t = static_cast<size_t>(primerType);
+        const fs::path primerRegionsPath = dir / toString(primerType) / "NAME";
+        tables.common[t] = readLines(primerRegionsPath.string() + "-common.txt");
+        tables.specific[t] = readLines(primerRegionsPath.string() + "-specific.txt");
+    }
+    return tables;
+}
+
+// The lines of a hit table without their genome index, by genome. For comparing tables whose genome indices are
+// assigned in the order in which the genomes come up.
+std::vector<std::vector<std::string>> groupByGenome(const std::vector<std::string>& lines) {
+    std::map<std::string, std::vector<std::string>> byGenome;
+    for (const std::string& line : lines) {
+        const size_t genomeBegin = line.find('\t', line.find('\t') + 1) + 1;
+        const size_t genomeEnd = line.find('\t', genomeBegin);
+        byGenome[line.substr(genomeBegin, genomeEnd - genomeBegin)].push_back(
+            line.substr(0, genomeBegin) + line.substr(genomeEnd + 1));
+    }
+
+    std::vector<std::vector<std::string>> groups;
+    for (auto& [genome, genomeLines] : byGenome) {
+        std::sort(genomeLines.begin(), genomeLines.end());
+        groups.push_back(std::move(genomeLines));
+    }
+    std::sort(groups.begin(), groups.end());
+    return groups;
+}
+
+// Compares two hit tables in any order. Prints a line that only one of them has if they differ.
+bool sameLines(std::vector<std::string> lines, std::vector<std::string> expected, const std::string& what) {
+    std::sort(lines.begin(), lines.end());
+    std::sort(expected.begin(), expected.end());
+    if (lines == expected)
+        return true;
+
+    std::vector<std::string> missing, extra;
+    std::set_difference(expected.begin(), expected.end(), lines.begin(), lines.end(), std::back_inserter(missing));
+    std::set_difference(lines.begin(), lines.end(), expected.begin(), expected.end(), std::back_inserter(extra));
+    std::printf("  %s: %zu lines, expected %zu", what.c_str(), lines.size(), expected.size());
+    if (!missing.empty())
+        std::printf(", missing `%s`", missing.front().c_str());
+    if (!extra.empty())
+        std::printf(", unexpected `%s`", extra.front().c_str());
+    std::printf("\n");
+    return false;
+}
+
+bool compareWithBaseline(const HitTables& tables, const HitTables& baseline, bool left) {
+    bool ok = true;
+    for (const PrimerType primerType : allPrimerTypes) {
+        const size_t t = static_cast<size_t>(primerType);
+        const std::string name = toString(primerType);
+        ok &= sameLines(tables.common[t], baseline.common[t], name + "-common.txt");
+        if (!left) {
+            ok &= sameLines(tables.specific[t], baseline.specific[t], name + "-specific.txt");
+        } else if (groupByGenome(tables.specific[t]) != groupByGenome(baseline.specific[t])) {
+            std::printf("  %s-specific.txt: differs from the baseline beyond the numbering of the genomes\n",
+                name.c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// The tables of every index aligned on its own, one after the other. With several indexes, alignPrimerCandidates has to
+// write the same, even though it aligns them at the same time. Only for an explicit background list, since with --left,
+// the genome indices of one index would continue from those of the previous ones.
+HitTables alignEachIndex(const CheckInputs& inputs, bool single_pass, const fs::path& dir) {
+    HitTables tables;
+    for (const std::string& indexPath : inputs.splitIndexPaths) {
+        const HitTables indexTables = alignCurrent(inputs, { false, { indexPath }, single_pass, 1 }, dir);
+        for (size_t t = 0; t < numPrimerTypes; t++) {
+            tables.common[t].insert(tables.common[t].end(), indexTables.common[t].begin(), indexTables.common[t].end());
+            tables.specific[t].insert(
+                tables.specific[t].end(), indexTables.specific[t].begin(), indexTables.specific[t].end());
+        }
+    }
+    return tables;
+}
+
+bool compareExactly(const HitTables& tables, const HitTables& expected, const char* expectedName) {
+    bool ok = true;
+    for (const PrimerType primerType : allPrimerTypes) {
+        const size_t t = static_cast<size_t>(primerType);
+        for (const auto& [lines, expectedLines, suffix] : {
+                 std::tuple(&tables.common[t], &expected.common[t], "-common.txt"),
+                 std::tuple(&tables.specific[t], &expected.specific[t], "-specific.txt") }) {
+            if (*lines != *expectedLines) {
+                std::printf("  %s%s: differs from %s\n", toString(primerType).c_str(), suffix, expectedName);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+std::string describe(const CheckRun& run) {
+    return std::string(run.left ? "--left" : "--specific") + ", " + std::to_string(run.indexPaths.size())
+        + (run.indexPaths.size() == 1 ? " index, " : " indexes, ")
+        + (run.single_pass ? "single pass" : "per primer type") + ", " + std::to_string(run.threads)
+        + (run.threads == 1 ? " thread" : " threads");
+}
+
+void report(const std::string& name, bool ok, const std::string& details = {}) {
+    std::printf("%-52s %-6s %s\n", name.c_str(), ok ? "ok" : "FAILED", details.c_str());
+}
+
+// The number of lines compared, so that a check passing on empty tables stands out
+std::string countLines(const HitTables& tables) {
+    size_t numCommon = 0, numSpecific = 0;
+    for (size_t t = 0; t < numPrimerTypes; t++) {
+        numCommon += tables.common[t].size();
+        numSpecific += tables.specific[t].size();
+    }
+    return std::to_string(numCommon) + " common, " + std::to_string(numSpecific) + " specific hits";
+}
+
+// Zips the files the way portable-glapd zips a workspace and reads them back with minizip's unzip, which checks the
+// CRC of every member
+bool checkWorkspaceZip(const std::vector<std::pair<fs::path, ZipCompression>>& files, const fs::path& zipPath) {
+    std::map<std::string, fs::path> srcByMember;
+    {
+        ThreadPool threadPool(4);
+        WorkspaceZip zip(zipFileWriter(zipPath.string()), threadPool, 6);
+        for (const auto& [src, compression] : files) {
+            const std::string member = std::to_string(srcByMember.size()) + "/" + src.filename().string();
+            zip.addFile(src, member, compression);
+            srcByMember[member] = src;
+        }
+        zip.close();
+    }
+
+    unzFile unz = unzOpen64(zipPath.string().c_str());
+    if (!unz) {
+        std::printf("  cannot open %s\n", zipPath.string().c_str());
+        return false;
+    }
+
+    bool ok = true;
+    size_t numMembers = 0;
+    for (int ret = unzGoToFirstFile(unz); ret == UNZ_OK; ret = unzGoToNextFile(unz)) {
+        char member[256];
+        unz_file_info64 info;
+        if (unzGetCurrentFileInfo64(unz, &info, member, sizeof(member), nullptr, 0, nullptr, 0) != UNZ_OK
+            || unzOpenCurrentFile(unz) != UNZ_OK) {
+            std::printf("  cannot read member %zu\n", numMembers);
+            ok = false;
+            break;
+        }
+
+        std::string contents;
+        char buffer[64 * 1024];
+        int n;
+        while ((n = unzReadCurrentFile(unz, buffer, sizeof(buffer))) > 0)
+            contents.append(buffer, n);
+        if (n < 0 || unzCloseCurrentFile(unz) != UNZ_OK) {
+            std::printf("  %s: cannot be decompressed or has a wrong CRC\n", member);
+            ok = false;
+        }
+
+        const auto it = srcByMember.find(member);
+        if (it == srcByMember.end()) {
+            std::printf("  %s: unexpected member\n", member);
+            ok = false;
+        } else if (contents != readFile(it->second)) {
+            std::printf("  %s: differs from %s\n", member, it->second.string().c_str());
+            ok = false;
+        }
+        numMembers++;
+    }
+    unzClose(unz);
+
+    if (numMembers != files.size()) {
+        std::printf("  %zu members, expected %zu\n", numMembers, files.size());
+        ok = false;
+    }
+    return ok;
+}
+
+} // namespace
+
+bool runChecks(const SyntheticDatasetOptions& options, const fs::path& dir) {
+    SyntheticDatasetOptions datasetOptions = options;
+    datasetOptions.numInvertedRepeats = std::max<size_t>(datasetOptions.numInvertedRepeats, 200);
+    const SyntheticDataset dataset = generateSyntheticDataset(dir, datasetOptions);
+
+    CheckInputs inputs;
+    inputs.refPath = dataset.refPath.string();
+    inputs.refSequence = readFastaSequence(dataset.refPath);
+    std::mt19937 rng(datasetOptions.seed);
+    for (const PrimerType primerType : allPrimerTypes)
+        inputs.candidates[static_cast<size_t>(primerType)] = generateCandidates(dataset, inputs.refSequence.size(), rng);
+    inputs.targetGenomeNames = readGenomeNames(dataset.targetListPath.string());
+    inputs.backgroundGenomeNames = readGenomeNames(dataset.backgroundListPath.string());
+    inputs.indexPath = buildIndex(dataset.indexFastaPath, dir / "index");
+    inputs.splitIndexPaths = buildSplitIndex(dataset, dir);
+
+    bool ok = true;
+    for (const bool left : { false, true }) {
+        const HitTables baseline = alignBaseline(inputs, left, dir);
+
+        for (const bool splitIndex : { false, true }) {
+            for (const bool single_pass : { false, true }) {
+                const std::vector<std::string> indexPaths = splitIndex
+                    ? inputs.splitIndexPaths
+                    : std::vector { inputs.indexPath };
+                const std::optional<HitTables> eachIndex = splitIndex && !left
+                    ? std::optional(alignEachIndex(inputs, single_pass, dir))
+                    : std::nullopt;
+
+                std::optional<HitTables> singleThreaded;
+                for (const int threads : { 1, 4 }) {
+                    const CheckRun run = { left, indexPaths, single_pass, threads };
+                    const HitTables tables = alignCurrent(inputs, run, dir);
+
+                    bool runOk = compareWithBaseline(tables, baseline, left);
+                    if (eachIndex)
+                        runOk &= compareExactly(tables, *eachIndex, "the indexes aligned one after the other");
+                    if (singleThreaded)
+                        runOk &= compareExactly(tables, *singleThreaded, "the single-threaded run");
+                    else
+                        singleThreaded = tables;
+
+                    report(describe(run), runOk, countLines(tables));
+                    ok &= runOk;
+                }
+            }
+        }
+    }
+
+    // The index FASTA is large enough to be deflated in several blocks
+    std::vector<std::pair<fs::path, ZipCompression>> files = { { dataset.indexFastaPath, ZipCompression::deflate } };
+    for (const fs::directory_entry& entry : fs::directory_iterator(dir)) {
+        const std::string filename = entry.path().filename().string();
+        if (filename.starts_with("index.") && (filename.ends_with(".ebwt") || filename.ends_with(".ebwtl")))
+            files.emplace_back(entry.path(), ZipCompression::store);
+    }
+    for (const PrimerType primerType : allPrimerTypes) {
+        files.emplace_back(dir / toString(primerType) / "NAME-common.txt", ZipCompression::deflate);
+        files.emplace_back(dir / toString(primerType) / "NAME-specific.txt", ZipCompression::deflate);
+    }
+    const bool zipOk = checkWorkspaceZip(files, dir / "workspace.zip");
+    report("workspace zip", zipOk, std::to_string(files.size()) + " members");
+    ok &= zipOk;
+
+    return ok;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <filesystem>
+
+#include "synthetic_genomes.h"
+
+// Aligns primers on a synthetic dataset with parpl at several thread counts, in one pass and per primer type, and
+// against one index and an index split in two. Compares the -common and -specific tables with those of parpl's
+// original line-by-line classification. Checks that the thread count does not change them at all, and that several
+// indexes give the same tables as aligning them one after the other. Also reads back a workspace zip of the outputs.
+//
+// Prints one line per check. Returns false if any of them fails.
+bool runChecks(const SyntheticDatasetOptions& options, const std::filesystem::path& dir);
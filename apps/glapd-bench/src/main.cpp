@@ -0,0 +1,452 @@
+// Benchmarks for the phases of the pipeline and their hot loops
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <bowtie.h>
+#include <glapd.h>
+#include <par.h>
+#include <parse.h>
+#include <trace.h>
+
+#include "check.h"
+#include "synthetic_genomes.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct BenchOptions {
+    SyntheticDatasetOptions dataset;
+    std::vector<unsigned> threadCounts; // for the phases that use threads
+    std::string parPath = "external/GLAPD/GLAPD/Par";
+    bool json = false;
+};
+
+struct Result {
+    std::string name;
+    unsigned numThreads = 1;
+    size_t numItems = 0;
+    const char* unit = "lines";
+    double seconds = 0.0;
+    double cpuSeconds = 0.0;
+    uint64_t peakMemoryBytes = 0;
+    double speedup = 1.0; // over the first thread count
+};
+
+// Prints results as they come in, or all at once as JSON
+class Reporter {
+public:
+    explicit Reporter(const BenchOptions& options) : m_options(options) {}
+
+    void add(const Result& result) {
+        m_results.push_back(result);
+        if (m_options.json)
+            return;
+
+        std::printf("%-30s %12zu %-10s %8.3f s %14.0f %s/s %6.2fx (%u threads)\n",
+            result.name.c_str(), result.numItems, result.unit, result.seconds, result.numItems / result.seconds,
+            result.unit, result.speedup, result.numThreads);
+    }
+
+    void finish() const {
+        if (!m_options.json)
+            return;
+
+        const SyntheticDatasetOptions& dataset = m_options.dataset;
+        std::printf("{\n"
+                    "  \"dataset\": {\"seed\": %u, \"genomeSize\": %zu, \"numTargets\": %zu, \"numBackground\": %zu, "
+                    "\"targetDivergence\": %g, \"backgroundDivergence\": %g},\n"
+                    "  \"hardwareConcurrency\": %u,\n"
+                    "  \"results\": [\n",
+            dataset.seed, dataset.genomeSize, dataset.numTargets, dataset.numBackground, dataset.targetDivergence,
+            dataset.backgroundDivergence, std::thread::hardware_concurrency());
+
+        for (size_t i = 0; i < m_results.size(); i++) {
+            const Result& result = m_results[i];
+            std::printf("    {\"name\": \"%s\", \"threads\": %u, \"items\": %zu, \"unit\": \"%s\", \"seconds\": %.6f, "
+                        "\"itemsPerSecond\": %.3f, \"speedup\": %.4f, \"cpuSeconds\": %.6f, \"peakMemoryBytes\": %llu}%s\n",
+                result.name.c_str(), result.numThreads, result.numItems, result.unit, result.seconds,
+                result.numItems / result.seconds, result.speedup, result.cpuSeconds,
+                static_cast<unsigned long long>(result.peakMemoryBytes), i + 1 < m_results.size() ? "," : "");
+        }
+
+        std::printf("  ]\n}\n");
+    }
+
+private:
+    const BenchOptions& m_options;
+    std::vector<Result> m_results;
+};
+
+// Runs fn until at least minSeconds have passed
+Result measure(size_t numLinesPerRun, const std::function<void()>& fn, double minSeconds = 1.0) {
+    Result result;
+    const ResourceUsage begin = getResourceUsage();
+    do {
+        fn();
+        result.numItems += numLinesPerRun;
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin.wallTime).count();
+    } while (result.seconds < minSeconds);
+
+    const ResourceUsage end = getResourceUsage();
+    result.cpuSeconds = end.cpuSeconds - begin.cpuSeconds;
+    result.peakMemoryBytes = end.peakMemoryBytes;
+    return result;
+}
+
+// Runs fn once, for phases that take long enough by themselves
+Result measureOnce(const std::function<void()>& fn) {
+    const ResourceUsage begin = getResourceUsage();
+    fn();
+    const ResourceUsage end = getResourceUsage();
+
+    Result result;
+    result.seconds = std::chrono::duration<double>(end.wallTime - begin.wallTime).count();
+    result.cpuSeconds = end.cpuSeconds - begin.cpuSeconds;
+    result.peakMemoryBytes = end.peakMemoryBytes;
+    return result;
+}
+
+std::string generatePrimerRegionLines(size_t numLines, std::mt19937& rng) {
+    std::uniform_int_distribution<int> pos(0, 10'000'000);
+    std::uniform_int_distribution<int> len(15, 25);
+    std::uniform_int_distribution<int> bit(0, 1);
+
+    std::string s;
+    for (size_t i = 0; i < numLines; i++) {
+        s += "pos:" + std::to_string(pos(rng)) + "\tlength:" + std::to_string(len(rng))
+            + "\t+:" + std::to_string(bit(rng)) + "\t-:" + std::to_string(bit(rng)) + "\n";
+    }
+    return s;
+}
+
+// Bowtie output as parpl reads it, with reads named by their index and references reported by index (--refidx)
+std::string generateBowtieLines(size_t numLines, size_t numReads, std::mt19937& rng) {
+    std::uniform_int_distribution<size_t> read(0, numReads - 1);
+    std::uniform_int_distribution<int> pos(0, 10'000'000);
+    std::uniform_int_distribution<int> genome(0, 999);
+    std::uniform_int_distribution<int> numMismatches(0, 2);
+    std::uniform_int_distribution<int> mismatchPos(0, 19);
+    std::uniform_int_distribution<int> bit(0, 1);
+
+    std::string s;
+    for (size_t i = 0; i < numLines; i++) {
+        s += std::to_string(read(rng));
+        s += bit(rng) ? "\t+\t" : "\t-\t";
+        s += std::to_string(genome(rng)) + "\t" + std::to_string(pos(rng)) + "\t";
+        for (int m = numMismatches(rng); m > 0; m--) {
+            s += std::to_string(mismatchPos(rng)) + ":A>G";
+            if (m > 1)
+                s += ",";
+        }
+        s += "\n";
+    }
+    return s;
+}
+
+void benchmarkPrimerRegionParsing(std::mt19937& rng, Reporter& reporter) {
+    const size_t numLines = 100'000;
+    const std::string input = generatePrimerRegionLines(numLines, rng);
+
+    long checksum = 0;
+    Result result = measure(numLines, [&] {
+        std::string_view rest = input;
+        while (!rest.empty()) {
+            const size_t newline = rest.find('\n');
+            PrimerInfo info;
+            if (parsePrimerRegionLine(rest.substr(0, newline), info))
+                checksum += info.pos;
+            rest.remove_prefix(newline + 1);
+        }
+    });
+
+    result.name = "parse primer regions";
+    reporter.add(result);
+    std::fprintf(stderr, "checksum %ld\n", checksum);
+}
+
+void benchmarkBowtieOutputParsing(std::mt19937& rng, Reporter& reporter) {
+    const size_t numLines = 100'000;
+    const size_t numReads = 20'000;
+    const std::string input = generateBowtieLines(numLines, numReads, rng);
+
+    long checksum = 0;
+    Result result = measure(numLines, [&] {
+        BowtieOutputParser parser([&](const BowtieHit& hit) {
+            // Like parpl, which looks up the primers of the read by its index
+            unsigned readIndex = 0;
+            const char* nameEnd = hit.readName.data() + hit.readName.size();
+            const auto [ptr, ec] = std::from_chars(hit.readName.data(), nameEnd, readIndex);
+            if (ec == std::errc() && ptr == nameEnd && readIndex < numReads)
+                checksum += readIndex + hit.refIndex + hit.mismatchPositions.size();
+        }, true);
+
+        // Feed in chunks, like bowtieAlign does
+        const size_t chunkSize = 64 * 1024;
+        for (size_t offset = 0; offset < input.size(); offset += chunkSize)
+            parser.feed(input.data() + offset, std::min(chunkSize, input.size() - offset));
+        parser.finish();
+    });
+
+    result.name = "parse bowtie output";
+    reporter.add(result);
+    std::fprintf(stderr, "checksum %ld\n", checksum);
+}
+
+// bowtie-build at every thread count. Returns the index path.
+std::string benchmarkIndexBuilding(const SyntheticDataset& dataset, const fs::path& dir, const BenchOptions& options, Reporter& reporter) {
+    const std::string fastaPathStr = dataset.indexFastaPath.string();
+    const std::string indexPathStr = (dir / "index").string();
+
+    double firstSeconds = 0.0;
+    for (const unsigned numThreads : options.threadCounts) {
+        const std::string numThreadsStr = std::to_string(numThreads);
+        const char* args[] = {
+            "bowtie-build",
+            "--quiet",
+            "--threads", numThreadsStr.c_str(),
+            fastaPathStr.c_str(),
+            indexPathStr.c_str(),
+        };
+
+        Result result = measureOnce([&] { bowtie_build(std::size(args), args); });
+        if (firstSeconds == 0.0)
+            firstSeconds = result.seconds;
+
+        result.name = "buildBowtieIndex";
+        result.numThreads = numThreads;
+        result.numItems = dataset.numBases;
+        result.unit = "bases";
+        result.speedup = firstSeconds / result.seconds;
+        reporter.add(result);
+    }
+
+    return indexPathStr;
+}
+
+// The phases of portable-glapd's runGlapd after building the index, with automatic background selection
+void benchmarkPipeline(const SyntheticDataset& dataset, const std::string& indexPath, const fs::path& dir, const BenchOptions& options, Reporter& reporter) {
+    const std::string dirStr = dir.string();
+    const std::string refPathStr = dataset.refPath.string();
+
+    for (const PrimerType primerType : { PrimerType::inner, PrimerType::outer, PrimerType::loop })
+        fs::create_directories(dir / toString(primerType));
+
+    // generateSingleRegionPrimers
+    {
+        const char* args[] = {
+            "Single",
+            "-in", refPathStr.c_str(),
+            "-out", "NAME",
+            "-dir", dirStr.c_str(),
+            "-par", options.parPath.c_str(),
+            "-loop",
+        };
+
+        Result result = measureOnce([&] { glapd_single_main(std::size(args), args); });
+        result.name = "generateSingleRegionPrimers";
+        result.numItems = options.dataset.genomeSize;
+        result.unit = "bases";
+        reporter.add(result);
+    }
+
+    // alignSingleRegionPrimers
+    PrimerCandidates candidates;
+    size_t numCandidates = 0;
+    for (const PrimerType primerType : { PrimerType::inner, PrimerType::outer, PrimerType::loop }) {
+        candidates[static_cast<size_t>(primerType)] = readPrimerCandidates(dirStr + "/" + toString(primerType) + "/NAME");
+        numCandidates += candidates[static_cast<size_t>(primerType)].size();
+    }
+
+    const PackedSequence refSequence = PackedSequence::loadFasta(refPathStr);
+
+    AlignOptions alignOptions;
+    alignOptions.refSequence = &refSequence;
+    alignOptions.indexes = { BowtieIndex::open(indexPath) };
+    alignOptions.primerTypes = { PrimerType::inner, PrimerType::outer, PrimerType::loop };
+    alignOptions.targetGenomeNames = readGenomeNames(dataset.targetListPath.string());
+    alignOptions.left = true;
+    alignOptions.single_pass = true;
+    alignOptions.tempDir = dirStr;
+
+    AlignResult alignResult;
+    double firstSeconds = 0.0;
+    for (const unsigned numThreads : options.threadCounts) {
+        alignOptions.threads = numThreads;
+
+        Result result = measureOnce([&] { alignResult = alignPrimerCandidates(candidates, alignOptions); });
+        if (firstSeconds == 0.0)
+            firstSeconds = result.seconds;
+
+        result.name = "alignSingleRegionPrimers";
+        result.numThreads = numThreads;
+        result.numItems = numCandidates;
+        result.unit = "primers";
+        result.speedup = firstSeconds / result.seconds;
+        reporter.add(result);
+    }
+
+    writeHitTables(alignResult, dirStr, "NAME");
+
+    // generateLampPrimerSets
+    {
+        const std::string outPathStr = (dir / "success.txt").string();
+        const char* args[] = {
+            "",
+            "-in", "NAME",
+            "-ref", refPathStr.c_str(),
+            "-dir", dirStr.c_str(),
+            "-out", outPathStr.c_str(),
+            "-num", "10",
+            "-par", options.parPath.c_str(),
+            "-common",
+            "-specific",
+            "-loop",
+        };
+
+        Result result = measureOnce([&] { glapd_lamp_main(std::size(args), args); });
+        result.name = "generateLampPrimerSets";
+        result.numItems = candidates[static_cast<size_t>(PrimerType::inner)].size();
+        result.unit = "primers";
+        reporter.add(result);
+    }
+}
+
+std::vector<unsigned> getDefaultThreadCounts() {
+    std::vector<unsigned> threadCounts = { 1 };
+    for (unsigned n = 2; n <= std::max(1u, std::thread::hardware_concurrency()); n *= 2)
+        threadCounts.push_back(n);
+    return threadCounts;
+}
+
+std::vector<unsigned> parseThreadCounts(const char* s) {
+    std::vector<unsigned> threadCounts;
+    std::stringstream ss(s);
+    std::string token;
+    while (std::getline(ss, token, ','))
+        threadCounts.push_back(std::max(1, std::stoi(token)));
+    return threadCounts;
+}
+
+void printUsage() {
+    std::printf("USAGE: glapd-bench [options] [parse] [index] [pipeline] [check]\n"
+                "  Runs all benchmarks if none are given.\n"
+                "\n"
+                "  parse     parsing hot loops of parpl\n"
+                "  index     bowtie-build\n"
+                "  pipeline  bowtie-build and all phases of a GLAPD run (needs --par)\n"
+                "  check     compares parpl's hit tables with its original classification, and reads back a workspace\n"
+                "            zip. Not a benchmark, so only run if given.\n"
+                "\n"
+                "  --seed <int>                   seed of the synthetic dataset (42)\n"
+                "  --genomeSize <bases>           (200000)\n"
+                "  --numTargets <int>             (5)\n"
+                "  --numBackground <int>          (20)\n"
+                "  --targetDivergence <0-1>       (0.005)\n"
+                "  --backgroundDivergence <0-1>   (0.1)\n"
+                "  --threads <n,n,...>            thread counts (1, 2, 4, ... up to the number of cores)\n"
+                "  --par <dir>                    GLAPD's Par directory (external/GLAPD/GLAPD/Par)\n"
+                "  --json                         print results as JSON\n");
+}
+
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    BenchOptions options;
+    options.threadCounts = getDefaultThreadCounts();
+
+    bool runParse = false;
+    bool runIndex = false;
+    bool runPipeline = false;
+    bool runCheck = false;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "parse") {
+            runParse = true;
+        } else if (arg == "index") {
+            runIndex = true;
+        } else if (arg == "pipeline") {
+            runPipeline = true;
+        } else if (arg == "check") {
+            runCheck = true;
+        } else if (arg == "--seed" && hasValue) {
+            options.dataset.seed = std::stoul(argv[++i]);
+        } else if (arg == "--genomeSize" && hasValue) {
+            options.dataset.genomeSize = std::stoull(argv[++i]);
+        } else if (arg == "--numTargets" && hasValue) {
+            options.dataset.numTargets = std::max(1ull, std::stoull(argv[++i]));
+        } else if (arg == "--numBackground" && hasValue) {
+            options.dataset.numBackground = std::stoull(argv[++i]);
+        } else if (arg == "--targetDivergence" && hasValue) {
+            options.dataset.targetDivergence = std::stod(argv[++i]);
+        } else if (arg == "--backgroundDivergence" && hasValue) {
+            options.dataset.backgroundDivergence = std::stod(argv[++i]);
+        } else if (arg == "--threads" && hasValue) {
+            options.threadCounts = parseThreadCounts(argv[++i]);
+        } else if (arg == "--par" && hasValue) {
+            options.parPath = argv[++i];
+        } else if (arg == "--json") {
+            options.json = true;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    if (!runParse && !runIndex && !runPipeline && !runCheck)
+        runParse = runIndex = runPipeline = true;
+
+    if (runPipeline && !fs::is_directory(options.parPath)) {
+        std::fprintf(stderr, "Par directory not found: %s\n", options.parPath.c_str());
+        return 1;
+    }
+
+    Reporter reporter(options);
+
+    if (runParse) {
+        std::mt19937 rng(options.dataset.seed);
+        benchmarkPrimerRegionParsing(rng, reporter);
+        benchmarkBowtieOutputParsing(rng, reporter);
+    }
+
+    if (runIndex || runPipeline) {
+        const fs::path dir = fs::temp_directory_path() / "glapd-bench";
+        fs::create_directories(dir);
+
+        const SyntheticDataset dataset = generateSyntheticDataset(dir, options.dataset);
+        const std::string indexPath = benchmarkIndexBuilding(dataset, dir, options, reporter);
+        if (runPipeline)
+            benchmarkPipeline(dataset, indexPath, dir, options, reporter);
+
+        fs::remove_all(dir);
+    }
+
+    reporter.finish();
+
+    if (runCheck) {
+        const fs::path dir = fs::temp_directory_path() / "glapd-check";
+        fs::create_directories(dir);
+
+        const bool ok = runChecks(options.dataset, dir);
+
+        fs::remove_all(dir);
+        if (!ok)
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "synthetic_genomes.h"
+
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char bases[] = "ACGT";
+
+std::string generateGenome(size_t size, std::mt19937& rng) {
+    std::uniform_int_distribution<int> base(0, 3);
+    std::string genome(size, 'A');
+    for (char& c : genome)
+        c = bases[base(rng)];
+    return genome;
+}
+
+char complement(char base) {
+    switch (base) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        default: return 'A';
+    }
+}
+
+std::string mutate(const std::string& ancestor, double divergence, std::mt19937& rng) {
+    std::uniform_int_distribution<int> base(0, 3);
+    std::bernoulli_distribution shouldMutate(divergence);
+    std::string genome = ancestor;
+    for (char& c : genome) {
+        if (shouldMutate(rng))
+            c = bases[base(rng)];
+    }
+    return genome;
+}
+
+// Copies segments of genome elsewhere as their reverse complement, so that some primers match both strands
+void addInvertedRepeats(std::string& genome, const SyntheticDatasetOptions& options, std::mt19937& rng,
+    std::vector<InvertedRepeat>& repeats) {
+    if (options.invertedRepeatSize > genome.size())
+        return;
+
+    std::uniform_int_distribution<size_t> offset(0, genome.size() - options.invertedRepeatSize);
+    for (size_t i = 0; i < options.numInvertedRepeats; i++) {
+        const InvertedRepeat repeat = { offset(rng), offset(rng), options.invertedRepeatSize };
+        const std::string segment = genome.substr(repeat.src, repeat.size);
+        for (size_t j = 0; j < repeat.size; j++)
+            genome[repeat.dst + repeat.size - 1 - j] = complement(segment[j]);
+        repeats.push_back(repeat);
+    }
+}
+
+void writeFastaRecord(std::ostream& out, const std::string& name, std::string_view genome) {
+    out << '>' << name << '\n';
+    for (size_t offset = 0; offset < genome.size(); offset += 80)
+        out << genome.substr(offset, 80) << '\n';
+}
+
+std::ofstream openForWriting(const fs::path& path) {
+    std::ofstream out(path);
+    if (!out)
+        throw std::runtime_error("Cannot open file: " + path.string());
+    return out;
+}
+
+} // namespace
+
+SyntheticDataset generateSyntheticDataset(const fs::path& dir, const SyntheticDatasetOptions& options) {
+    std::mt19937 rng(options.seed);
+
+    SyntheticDataset dataset;
+    dataset.refPath = dir / "ref.fa";
+    dataset.targetListPath = dir / "target.fa";
+    dataset.backgroundListPath = dir / "background.fa";
+    dataset.indexFastaPath = dir / "index.fa";
+
+    std::ofstream refOut = openForWriting(dataset.refPath);
+    std::ofstream targetListOut = openForWriting(dataset.targetListPath);
+    std::ofstream backgroundListOut = openForWriting(dataset.backgroundListPath);
+    std::ofstream indexOut = openForWriting(dataset.indexFastaPath);
+
+    std::string targetAncestor = generateGenome(options.genomeSize, rng);
+    addInvertedRepeats(targetAncestor, options, rng, dataset.invertedRepeats);
+    for (size_t i = 0; i < options.numTargets; i++) {
+        const std::string name = "target" + std::to_string(i);
+        const std::string genome = mutate(targetAncestor, options.targetDivergence, rng);
+
+        if (i == 0)
+            writeFastaRecord(refOut, name, genome);
+        targetListOut << '>' << name << '\n';
+        writeFastaRecord(indexOut, name, genome);
+        dataset.numBases += genome.size();
+    }
+
+    const std::string backgroundAncestor = mutate(targetAncestor, options.backgroundDivergence, rng);
+    for (size_t i = 0; i < options.numBackground; i++) {
+        const std::string name = "background" + std::to_string(i);
+        const std::string genome = mutate(backgroundAncestor, options.backgroundDivergence, rng);
+
+        backgroundListOut << '>' << name << '\n';
+        writeFastaRecord(indexOut, name, genome);
+        dataset.numBases += genome.size();
+    }
+
+    return dataset;
+}
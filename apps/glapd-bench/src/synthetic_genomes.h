@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+// Sizes and divergence of a synthetic dataset. The same options and seed always produce the same files.
+struct SyntheticDatasetOptions {
+    uint32_t seed = 42;
+    size_t genomeSize = 200'000;
+    size_t numTargets = 5;
+    size_t numBackground = 20;
+    double targetDivergence = 0.005; // fraction of positions in which targets differ from their common ancestor
+    double backgroundDivergence = 0.1; // same for the background genomes, whose ancestor is a mutated target ancestor
+    size_t numInvertedRepeats = 0; // segments of the target ancestor copied elsewhere as their reverse complement
+    size_t invertedRepeatSize = 100;
+};
+
+// A segment of the target ancestor at src, whose reverse complement is at dst
+struct InvertedRepeat {
+    size_t src;
+    size_t dst;
+    size_t size;
+};
+
+// Inputs of one GLAPD run, like the files the web app passes to portable-glapd
+struct SyntheticDataset {
+    std::filesystem::path refPath; // the first target genome
+    std::filesystem::path targetListPath;
+    std::filesystem::path backgroundListPath;
+    std::filesystem::path indexFastaPath; // targets and background, to build the Bowtie index from
+    size_t numBases = 0; // in indexFastaPath
+    std::vector<InvertedRepeat> invertedRepeats; // at the same offsets in refPath, up to mutations
+};
+
+SyntheticDataset generateSyntheticDataset(const std::filesystem::path& dir, const SyntheticDatasetOptions& options);
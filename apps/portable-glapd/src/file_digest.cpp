@@ -0,0 +1,144 @@
+#include "file_digest.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+namespace {
+
+// SHA-256 (FIPS 180-4). zlib only has checksums, and this is the only hash the app needs.
+class Sha256 {
+public:
+    void update(const unsigned char* data, size_t size) {
+        m_totalSize += size;
+
+        if (m_bufferSize > 0) {
+            const size_t n = std::min(size, blockSize - m_bufferSize);
+            std::memcpy(m_buffer.data() + m_bufferSize, data, n);
+            m_bufferSize += n;
+            data += n;
+            size -= n;
+            if (m_bufferSize < blockSize)
+                return;
+            processBlock(m_buffer.data());
+            m_bufferSize = 0;
+        }
+
+        for (; size >= blockSize; data += blockSize, size -= blockSize)
+            processBlock(data);
+
+        std::memcpy(m_buffer.data(), data, size);
+        m_bufferSize = size;
+    }
+
+    std::array<unsigned char, 32> finish() {
+        const uint64_t bitSize = m_totalSize * 8;
+
+        // 0x80, zeros up to 56 bytes mod 64, then the size in bits, big-endian
+        const unsigned char pad = 0x80;
+        update(&pad, 1);
+        const unsigned char zero = 0;
+        while (m_bufferSize != blockSize - 8)
+            update(&zero, 1);
+        unsigned char sizeBytes[8];
+        for (int i = 0; i < 8; i++)
+            sizeBytes[i] = static_cast<unsigned char>(bitSize >> (56 - 8 * i));
+        update(sizeBytes, 8);
+
+        std::array<unsigned char, 32> digest;
+        for (int i = 0; i < 8; i++) {
+            for (int j = 0; j < 4; j++)
+                digest[4 * i + j] = static_cast<unsigned char>(m_state[i] >> (24 - 8 * j));
+        }
+        return digest;
+    }
+
+private:
+    static constexpr size_t blockSize = 64;
+
+    static uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void processBlock(const unsigned char* block) {
+        static constexpr uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 | uint32_t(block[4 * i + 2]) << 8 | block[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+        uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+        for (int i = 0; i < 64; i++) {
+            const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        m_state[0] += a;
+        m_state[1] += b;
+        m_state[2] += c;
+        m_state[3] += d;
+        m_state[4] += e;
+        m_state[5] += f;
+        m_state[6] += g;
+        m_state[7] += h;
+    }
+
+private:
+    std::array<uint32_t, 8> m_state = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    std::array<unsigned char, blockSize> m_buffer;
+    size_t m_bufferSize = 0;
+    uint64_t m_totalSize = 0;
+};
+
+} // namespace
+
+std::string computeFileDigest(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open file: " + path);
+
+    Sha256 sha;
+    const size_t bufSize = 1024 * 1024; // 1 MB
+    std::unique_ptr<char[]> buf = std::make_unique<char[]>(bufSize);
+    while (in) {
+        in.read(buf.get(), bufSize);
+        sha.update(reinterpret_cast<const unsigned char*>(buf.get()), in.gcount());
+    }
+
+    constexpr char hexDigits[] = "0123456789abcdef";
+    std::string digest;
+    for (const unsigned char byte : sha.finish()) {
+        digest += hexDigits[byte >> 4];
+        digest += hexDigits[byte & 0xf];
+    }
+    return digest;
+}
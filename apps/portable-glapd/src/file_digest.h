@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+
+// SHA-256 of the contents of a file, as 64 hex digits. Keys the index cache and the phase memo, so that different
+// inputs never share outputs.
+std::string computeFileDigest(const std::string& path);
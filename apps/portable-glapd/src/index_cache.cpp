@@ -0,0 +1,98 @@
+#include "index_cache.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static const char* indexBaseName = "index";
+
+static std::uintmax_t getDirectorySize(const fs::path& dir) {
+    std::uintmax_t size = 0;
+    for (const fs::directory_entry& entry : fs::directory_iterator(dir)) {
+        if (entry.is_regular_file())
+            size += entry.file_size();
+    }
+    return size;
+}
+
+IndexCache::IndexCache(fs::path dir, std::uintmax_t maxBytes)
+    : m_dir(std::move(dir))
+    , m_maxBytes(maxBytes)
+{
+    fs::create_directories(m_dir);
+}
+
+std::optional<std::string> IndexCache::find(const std::string& key) {
+    const fs::path entryDir = getEntryDir(key);
+    if (!fs::is_directory(entryDir))
+        return std::nullopt;
+
+    // Mark as recently used
+    fs::last_write_time(entryDir, fs::file_time_type::clock::now());
+
+    return (entryDir / indexBaseName).string();
+}
+
+std::string IndexCache::beginInsert(const std::string& key) {
+    const fs::path stagingDir = getStagingDir(key);
+    fs::remove_all(stagingDir);
+    fs::create_directories(stagingDir);
+    return (stagingDir / indexBaseName).string();
+}
+
+std::string IndexCache::finishInsert(const std::string& key) {
+    const fs::path entryDir = getEntryDir(key);
+
+    // Only complete entries are ever visible under their key
+    fs::remove_all(entryDir);
+    fs::rename(getStagingDir(key), entryDir);
+
+    if (m_maxBytes > 0)
+        evict(key);
+
+    return (entryDir / indexBaseName).string();
+}
+
+void IndexCache::abortInsert(const std::string& key) {
+    std::error_code ec;
+    fs::remove_all(getStagingDir(key), ec);
+}
+
+fs::path IndexCache::getEntryDir(const std::string& key) const {
+    return m_dir / key;
+}
+
+fs::path IndexCache::getStagingDir(const std::string& key) const {
+    return m_dir / (key + ".tmp");
+}
+
+void IndexCache::evict(const std::string& keep) {
+    struct Entry {
+        fs::path dir;
+        fs::file_time_type lastUsed;
+        std::uintmax_t size;
+    };
+
+    std::vector<Entry> entries;
+    std::uintmax_t totalSize = 0;
+    for (const fs::directory_entry& entry : fs::directory_iterator(m_dir)) {
+        // Staging directories of inserts in progress are neither counted nor evicted
+        if (!entry.is_directory() || entry.path().extension() == ".tmp")
+            continue;
+        const std::uintmax_t size = getDirectorySize(entry.path());
+        totalSize += size;
+        if (entry.path().filename() != keep)
+            entries.push_back({ entry.path(), entry.last_write_time(), size });
+    }
+
+    // Least recently used first
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.lastUsed < b.lastUsed; });
+
+    for (const Entry& entry : entries) {
+        if (totalSize <= m_maxBytes)
+            break;
+        fs::remove_all(entry.dir);
+        totalSize -= entry.size;
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+// On-disk cache of Bowtie indexes.
+//
+// Entries are keyed by the computeFileDigest() of the FASTA file an index was built from, since bowtie-build runs
+// without options that affect the index. Each entry is a directory `<key>` holding the `index.*` files. When the cache
+// grows beyond its size limit, the least recently used entries are removed.
+//
+// This is the eviction policy of native runs. The web worker keeps only the current entry in the cache directory and
+// evicts from IndexedDB itself, so it runs without a limit here.
+class IndexCache {
+public:
+    // No entries are evicted if maxBytes is 0
+    IndexCache(std::filesystem::path dir, std::uintmax_t maxBytes);
+
+    // Returns the index path (as passed to bowtie) if the cache has an entry for key
+    std::optional<std::string> find(const std::string& key);
+
+    // Returns the index path (as passed to bowtie-build) to build a new entry into
+    std::string beginInsert(const std::string& key);
+
+    // Publishes an entry built into the path returned by beginInsert, and returns its index path
+    std::string finishInsert(const std::string& key);
+
+    // Discards what was built into the path returned by beginInsert, e.g. when bowtie-build failed
+    void abortInsert(const std::string& key);
+
+private:
+    std::filesystem::path getEntryDir(const std::string& key) const;
+    std::filesystem::path getStagingDir(const std::string& key) const;
+    void evict(const std::string& keep);
+
+private:
+    std::filesystem::path m_dir;
+    std::uintmax_t m_maxBytes;
+};
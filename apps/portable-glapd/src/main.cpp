@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <exception>
@@ -7,17 +10,24 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
-#include <zip.h>
+#include <zlib.h>
 
 #include "bowtie.h"
+#include "file_digest.h"
 #include "glapd.h"
+#include "index_cache.h"
 #include "par.h"
 #include "signals.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "workspace_zip.h"
 
 #if EMSCRIPTEN
 #include <emscripten.h>
@@ -31,30 +41,40 @@ const char* workingDirectory = "/tmp";
 const char* bowtieIndexPath = "/tmp/index";
 
 static std::string s_parPath;
+static std::string s_bowtieIndexPath = bowtieIndexPath; // differs when using the index cache
+static std::shared_ptr<const BowtieIndex> s_bowtieIndex; // keeps the index resident for all alignments
+
+// Invalid arguments or inputs. Thrown instead of exiting, so the web worker can run the next job in the same module.
+class ArgumentError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
 
 [[noreturn]]
 static void die(const char* fmt, ...) {
-    // Append \n
-    std::string fmtWithNewline = fmt;
-    fmtWithNewline += "\n";
-
     va_list args;
     va_start(args, fmt);
-    vfprintf(stderr, fmtWithNewline.c_str(), args);
-    va_end(args);
+    va_list argsCopy;
+    va_copy(argsCopy, args);
 
-    fflush(stderr);
+    const int size = std::vsnprintf(nullptr, 0, fmt, args);
+    std::string message(std::max(size, 0), '\0');
+    std::vsnprintf(message.data(), message.size() + 1, fmt, argsCopy);
 
-    std::exit(1);
+    va_end(argsCopy);
+    va_end(args);
+
+    throw ArgumentError(message);
 }
 
 static std::string getParPath() {
-    // For dev builds, use external/glapd/GLAPD/Par
-    const char* candidate = "external/glapd/GLAPD/Par";
-    if (fs::is_directory(candidate))
-        return candidate;
+    // Embedded into web builds as external/glapd/GLAPD/Par. Native dev builds run from the repository root.
+    for (const char* candidate : { "external/glapd/GLAPD/Par", "external/GLAPD/GLAPD/Par" }) {
+        if (fs::is_directory(candidate))
+            return candidate;
+    }
 
-    die("Could not determine par path");
+    die("Could not determine par path, use --par");
 }
 
 enum class BackgroundMode {
@@ -99,6 +119,17 @@ struct Args {
     unsigned numPrimersToGenerate = 10;
 
     unsigned numThreads = 1;
+
+    std::string indexCacheDir = ""; // no caching if empty
+    unsigned indexCacheSizeLimitMB = 4096; // 0 for no limit, when the caller evicts entries itself
+
+    unsigned workspaceCompressionLevel = Z_BEST_SPEED; // for text files, indexes are stored uncompressed
+    bool includeIndexInWorkspace = true; // the index can be rebuilt from inputs/index.fasta
+    bool deferWorkspace = false; // the workspace is only created by create_workspace_zip()
+
+    std::string tracePath = ""; // Chrome trace-event JSON, no tracing if empty
+
+    std::string parPath = ""; // GLAPD's thermodynamic parameters, the embedded ones if empty
 };
 
 std::string renderArgs(const Args& args) {
@@ -108,13 +139,27 @@ std::string renderArgs(const Args& args) {
         "maxNumMismatchesInBackground: {}\n"
         "includeLoopPrimers: {}\n"
         "numPrimersToGenerate: {}\n"
-        "numThreads: {}\n",
+        "numThreads: {}\n"
+        "indexCacheDir: {}\n"
+        "indexCacheSizeLimitMB: {}\n"
+        "workspaceCompressionLevel: {}\n"
+        "includeIndexInWorkspace: {}\n"
+        "deferWorkspace: {}\n"
+        "tracePath: {}\n"
+        "parPath: {}\n",
         args.maxNumMismatchesInTarget,
         toString(args.backgroundMode),
         args.maxNumMismatchesInBackground,
         args.includeLoopPrimers,
         args.numPrimersToGenerate,
-        args.numThreads);
+        args.numThreads,
+        args.indexCacheDir,
+        args.indexCacheSizeLimitMB,
+        args.workspaceCompressionLevel,
+        args.includeIndexInWorkspace,
+        args.deferWorkspace,
+        args.tracePath,
+        args.parPath);
 }
 
 unsigned parseUintArg(const char* name, const char* value) {
@@ -182,6 +227,37 @@ Args parseArgs(int argc, char* argv[]) {
                 die("Missing argument value --numThreads");
             const char* val = argv[++i];
             args.numThreads = parseUintArg("numThreads", val);
+        } else if (arg == "--indexCacheDir") {
+            if (i + 1 >= argc)
+                die("Missing argument value --indexCacheDir");
+            const char* val = argv[++i];
+            args.indexCacheDir = val;
+        } else if (arg == "--indexCacheSizeLimitMB") {
+            if (i + 1 >= argc)
+                die("Missing argument value --indexCacheSizeLimitMB");
+            const char* val = argv[++i];
+            args.indexCacheSizeLimitMB = parseUintArg("indexCacheSizeLimitMB", val);
+        } else if (arg == "--workspaceCompressionLevel") {
+            if (i + 1 >= argc)
+                die("Missing argument value --workspaceCompressionLevel");
+            const char* val = argv[++i];
+            args.workspaceCompressionLevel = parseUintArg("workspaceCompressionLevel", val);
+            if (args.workspaceCompressionLevel > Z_BEST_COMPRESSION)
+                die("Illegal value for --workspaceCompressionLevel");
+        } else if (arg == "--excludeIndexFromWorkspace") {
+            args.includeIndexInWorkspace = false;
+        } else if (arg == "--deferWorkspace") {
+            args.deferWorkspace = true;
+        } else if (arg == "--trace") {
+            if (i + 1 >= argc)
+                die("Missing argument value --trace");
+            const char* val = argv[++i];
+            args.tracePath = val;
+        } else if (arg == "--par") {
+            if (i + 1 >= argc)
+                die("Missing argument value --par");
+            const char* val = argv[++i];
+            args.parPath = val;
         } else {
             die("Unknown argument: %s", arg.data());
         }
@@ -190,20 +266,164 @@ Args parseArgs(int argc, char* argv[]) {
     return args;
 }
 
-void buildBowtieIndex(const Args& args) {
-    notify_about_to_start_phase("buildBowtieIndex");
+// A phase of a run. Reported to the web UI when it starts and finishes, and recorded in the trace.
+class Phase {
+public:
+    explicit Phase(const char* name)
+        : m_name(name)
+        , m_trace(name, "phase")
+    {
+        notify_about_to_start_phase(name);
+    }
+
+    ~Phase() {
+        notify_finished_phase(m_name, m_trace.getElapsedSeconds());
+    }
+
+    Phase(const Phase&) = delete;
+    Phase& operator=(const Phase&) = delete;
+
+private:
+    const char* m_name;
+    TraceScope m_trace;
+};
+
+static void runBowtieBuild(const Args& args, const std::string& outputPath) {
+    TraceScope trace("bowtie-build");
 
     std::vector<const char*> bowtieArgs {
         "bowtie-build", // program name
-        args.indexPath.c_str(),
-        bowtieIndexPath,
     };
 
-    bowtie_build(bowtieArgs.size(), bowtieArgs.data());
+    // Parallel suffix sorting and block-wise BWT construction. Does not affect the index, so the index cache is keyed
+    // by the FASTA file alone. Options that change the index would have to become part of the key.
+    const std::string numThreadsStr = std::to_string(args.numThreads);
+    bowtieArgs.push_back("--threads");
+    bowtieArgs.push_back(numThreadsStr.c_str());
+
+    bowtieArgs.push_back(args.indexPath.c_str());
+    bowtieArgs.push_back(outputPath.c_str());
+
+    const int exitCode = bowtie_build(bowtieArgs.size(), bowtieArgs.data());
+    if (exitCode != 0)
+        throw std::runtime_error(std::format("bowtie-build failed with exit code {}", exitCode));
+}
+
+static void buildOrFindBowtieIndex(const Args& args, const std::string& indexDigest) {
+    if (args.indexCacheDir.empty()) {
+        runBowtieBuild(args, bowtieIndexPath);
+        s_bowtieIndexPath = bowtieIndexPath;
+        return;
+    }
+
+    try {
+        IndexCache cache(args.indexCacheDir, std::uintmax_t(args.indexCacheSizeLimitMB) * 1024 * 1024);
+        const std::string& key = indexDigest;
+
+        if (std::optional<std::string> cachedPath = cache.find(key)) {
+            std::cout << "Using cached Bowtie index " << key << std::endl;
+            s_bowtieIndexPath = *cachedPath;
+            return;
+        }
+
+        const std::string stagingPath = cache.beginInsert(key);
+        try {
+            runBowtieBuild(args, stagingPath);
+        } catch (...) {
+            // A partial index must never be published under the key, or be persisted to IndexedDB in staging
+            cache.abortInsert(key);
+            throw;
+        }
+        s_bowtieIndexPath = cache.finishInsert(key);
+    } catch (const fs::filesystem_error& e) {
+        std::cerr << "Bowtie index cache unavailable, building without it: " << e.what() << std::endl;
+        runBowtieBuild(args, bowtieIndexPath);
+        s_bowtieIndexPath = bowtieIndexPath;
+    }
+}
+
+// The phases of the previous run whose outputs are still around, by the inputs and parameters they were computed
+// from. A re-run with tweaked parameters only repeats the phases whose key changed.
+class PhaseMemo {
+public:
+    enum Step {
+        bowtieIndex,
+        singleRegionPrimers,
+        alignment, // of all single region primers, before filtering by maxNumMismatchesInTarget
+        hitTables,
+        lampPrimerSets,
+        numSteps,
+    };
+
+    using Keys = std::array<std::string, numSteps>;
+
+    bool isUpToDate(Step step, const std::string& key) const {
+        return m_keys[step] == key;
+    }
+
+    // Called before a step runs. Its outputs, and those of the steps after it, are about to be replaced.
+    void invalidate(Step step) {
+        for (size_t i = step; i < numSteps; i++)
+            m_keys[i].clear();
+    }
+
+    void markDone(Step step, const std::string& key) {
+        m_keys[step] = key;
+    }
+
+private:
+    Keys m_keys;
+};
+
+static PhaseMemo s_phaseMemo;
+static std::optional<AlignResult> s_alignResult; // of PhaseMemo::alignment
+
+// Each key holds the keys of the steps the step reads the outputs of
+static PhaseMemo::Keys computePhaseKeys(const Args& args, const std::string& indexDigest) {
+    const std::string refDigest = computeFileDigest(args.refPath);
+    const std::string targetListDigest = args.targetListPath.empty() ? "" : computeFileDigest(args.targetListPath);
+    const std::string backgroundListDigest = args.backgroundMode == BackgroundMode::fromFile ? computeFileDigest(args.backgroundListPath) : "";
+
+    PhaseMemo::Keys keys;
+    keys[PhaseMemo::bowtieIndex] = indexDigest;
+    keys[PhaseMemo::singleRegionPrimers] = std::format("ref={} loop={} par={}",
+        refDigest, args.includeLoopPrimers, s_parPath);
+    keys[PhaseMemo::alignment] = std::format("[{}] [{}] target={} background={}:{} mis_s={}",
+        keys[PhaseMemo::bowtieIndex], keys[PhaseMemo::singleRegionPrimers], targetListDigest,
+        toString(args.backgroundMode), backgroundListDigest, args.maxNumMismatchesInBackground);
+    keys[PhaseMemo::hitTables] = std::format("[{}] mis_c={}",
+        keys[PhaseMemo::alignment], args.maxNumMismatchesInTarget);
+    keys[PhaseMemo::lampPrimerSets] = std::format("[{}] num={}",
+        keys[PhaseMemo::hitTables], args.numPrimersToGenerate);
+    return keys;
+}
+
+void buildBowtieIndex(const Args& args, const std::string& indexDigest, const std::string& key) {
+    const Phase phase("buildBowtieIndex");
+
+    if (s_bowtieIndex && s_phaseMemo.isUpToDate(PhaseMemo::bowtieIndex, key)) {
+        std::cout << "Reusing Bowtie index of the previous run" << std::endl;
+        return;
+    }
+    s_phaseMemo.invalidate(PhaseMemo::bowtieIndex);
+
+    // bowtie-build may overwrite the files of a previous run, which must not be mapped anymore
+    s_bowtieIndex.reset();
+
+    buildOrFindBowtieIndex(args, indexDigest);
+    s_bowtieIndex = BowtieIndex::open(s_bowtieIndexPath);
+
+    s_phaseMemo.markDone(PhaseMemo::bowtieIndex, key);
 }
 
-void generateSingleRegionPrimers(const Args& args) {
-    notify_about_to_start_phase("generateSingleRegionPrimers");
+void generateSingleRegionPrimers(const Args& args, const std::string& key) {
+    const Phase phase("generateSingleRegionPrimers");
+
+    if (s_phaseMemo.isUpToDate(PhaseMemo::singleRegionPrimers, key)) {
+        std::cout << "Reusing single region primers of the previous run" << std::endl;
+        return;
+    }
+    s_phaseMemo.invalidate(PhaseMemo::singleRegionPrimers);
 
     std::cout << "Generating single region primers" << std::endl;
 
@@ -218,55 +438,92 @@ void generateSingleRegionPrimers(const Args& args) {
     if (args.includeLoopPrimers)
         glapdArgs.push_back("-loop");
 
-    glapd_single_main(glapdArgs.size(), glapdArgs.data());
-}
+    {
+        TraceScope trace("GLAPD Single");
+        glapd_single_main(glapdArgs.size(), glapdArgs.data());
+    }
 
-void alignSingleRegionPrimers(const Args& args) {
-    notify_about_to_start_phase("alignSingleRegionPrimers");
+    s_phaseMemo.markDone(PhaseMemo::singleRegionPrimers, key);
+}
 
+static void alignAllSingleRegionPrimers(const Args& args) {
     std::cout << "Aligning single region primers" << std::endl;
 
-    const std::string misCStr = std::to_string(args.maxNumMismatchesInTarget);
-    const std::string misSStr = std::to_string(args.maxNumMismatchesInBackground);
-    const std::string numThreadsStr = std::to_string(args.numThreads);
-
-    std::vector<const char*> parplArgs{
-        "", // program name, unused
-        "--in", "NAME",
-        "--ref", args.refPath.c_str(),
-        "--dir", workingDirectory,
-        "--index", bowtieIndexPath,
-        "--mis_c", misCStr.c_str(),
-        "--mis_s", misSStr.c_str(),
-        "--threads", numThreadsStr.c_str(),
-    };
+    const PackedSequence refSequence = [&] {
+        TraceScope trace("load reference");
+        return PackedSequence::loadFasta(args.refPath);
+    }();
 
+    AlignOptions options;
+    options.refSequence = &refSequence;
+    options.indexes = { s_bowtieIndex };
     if (args.includeLoopPrimers)
-        parplArgs.push_back("--loop");
+        options.primerTypes.push_back(PrimerType::loop);
 
     if (!args.targetListPath.empty())
-    {
-        parplArgs.push_back("--common");
-        parplArgs.push_back(args.targetListPath.c_str());
-    }
+        options.targetGenomeNames = readGenomeNames(args.targetListPath);
 
     switch (args.backgroundMode) {
     case BackgroundMode::none:
         break; // nothing to do
     case BackgroundMode::automatic:
-        parplArgs.push_back("--left");
+        options.left = true;
         break;
     case BackgroundMode::fromFile:
-        parplArgs.push_back("--specific");
-        parplArgs.push_back(args.backgroundListPath.c_str());
+        options.backgroundGenomeNames = readGenomeNames(args.backgroundListPath);
         break;
     }
 
-    parpl_main(parplArgs.size(), parplArgs.data());
+    // bowtie reports nothing above mis_s, so this keeps all target hits. They are narrowed down to
+    // maxNumMismatchesInTarget afterwards, which is all that changes when only that is tweaked.
+    options.mis_c = args.maxNumMismatchesInBackground;
+    options.mis_s = args.maxNumMismatchesInBackground;
+    options.threads = args.numThreads;
+    options.single_pass = true;
+    options.tempDir = workingDirectory;
+
+    // Written by GLAPD's Single stage
+    PrimerCandidates candidates;
+    for (const PrimerType primerType : options.primerTypes)
+        candidates[static_cast<size_t>(primerType)] = readPrimerCandidates(std::format("{}/{}/NAME", workingDirectory, toString(primerType)));
+
+    s_alignResult = alignPrimerCandidates(candidates, options);
+}
+
+void alignSingleRegionPrimers(const Args& args, const std::string& alignmentKey, const std::string& hitTablesKey) {
+    const Phase phase("alignSingleRegionPrimers");
+
+    if (s_alignResult && s_phaseMemo.isUpToDate(PhaseMemo::alignment, alignmentKey)) {
+        std::cout << "Reusing alignments of the previous run" << std::endl;
+    } else {
+        s_phaseMemo.invalidate(PhaseMemo::alignment);
+        s_alignResult.reset();
+        alignAllSingleRegionPrimers(args);
+        s_phaseMemo.markDone(PhaseMemo::alignment, alignmentKey);
+    }
+
+    if (s_phaseMemo.isUpToDate(PhaseMemo::hitTables, hitTablesKey))
+        return;
+    s_phaseMemo.invalidate(PhaseMemo::hitTables);
+
+    // Read by GLAPD's LAMP stage
+    TraceScope trace("write hit tables");
+    if (args.maxNumMismatchesInTarget >= args.maxNumMismatchesInBackground)
+        writeHitTables(*s_alignResult, workingDirectory, "NAME");
+    else
+        writeHitTables(filterTargetHits(*s_alignResult, args.maxNumMismatchesInTarget), workingDirectory, "NAME");
+
+    s_phaseMemo.markDone(PhaseMemo::hitTables, hitTablesKey);
 }
 
-void generateLampPrimerSets(const Args& args) {
-    notify_about_to_start_phase("generateLampPrimerSets");
+void generateLampPrimerSets(const Args& args, const std::string& key) {
+    const Phase phase("generateLampPrimerSets");
+
+    if (s_phaseMemo.isUpToDate(PhaseMemo::lampPrimerSets, key)) {
+        std::cout << "Reusing LAMP primer sets of the previous run" << std::endl;
+        return;
+    }
+    s_phaseMemo.invalidate(PhaseMemo::lampPrimerSets);
 
     std::cout << "Generating LAMP primer sets" << std::endl;
 
@@ -291,93 +548,141 @@ void generateLampPrimerSets(const Args& args) {
     if (args.includeLoopPrimers)
         glapdArgs.push_back("-loop");
 
-    glapd_lamp_main(glapdArgs.size(), glapdArgs.data());
-}
-
-static void createFileInZipFromString(zipFile zip, const std::filesystem::path& dst, const std::string& contents)
-{
-    zipOpenNewFileInZip(zip, dst.string().c_str(), nullptr, nullptr, 0, nullptr, 0, nullptr, Z_DEFLATED, Z_DEFAULT_COMPRESSION);
-    zipWriteInFileInZip(zip, contents.c_str(), contents.size());
-    zipCloseFileInZip(zip);
-}
-
-static void copyFileIntoZip(zipFile zip, const std::filesystem::path& src, const std::filesystem::path& dst)
-{
-    zipOpenNewFileInZip(zip, dst.string().c_str(), nullptr, nullptr, 0, nullptr, 0, nullptr, Z_DEFLATED, Z_DEFAULT_COMPRESSION);
-
-    // Read file in 1MB chunks
-    std::ifstream in(src);
-    const size_t bufSize = 1024 * 1024; // 1 MB
-    std::unique_ptr<char[]> buf = std::make_unique<char[]>(bufSize);
-    while (in) {
-        in.read(buf.get(), bufSize);
-        const size_t numRead = in.gcount();
-        zipWriteInFileInZip(zip, buf.get(), numRead);
+    {
+        TraceScope trace("LAMP search");
+        glapd_lamp_main(glapdArgs.size(), glapdArgs.data());
     }
 
-    zipCloseFileInZip(zip);
+    s_phaseMemo.markDone(PhaseMemo::lampPrimerSets, key);
 }
 
-static void createWorkspaceZip(const Args& args)
+static void createWorkspaceZip(const Args& args, ZipWriter writer)
 {
-    notify_about_to_start_phase("createWorkspaceZip");
+    std::cout << "Archiving workspace" << std::endl;
+    TraceScope trace("createWorkspaceZip", "phase");
 
-    zipFile zip = zipOpen("workspace.zip", APPEND_STATUS_CREATE);
+    ThreadPool threadPool(args.numThreads);
+    WorkspaceZip zip(std::move(writer), threadPool, args.workspaceCompressionLevel);
 
     // Inputs
-    createFileInZipFromString(zip, "inputs/options.txt", renderArgs(args));
-    copyFileIntoZip(zip, args.indexPath, "inputs/index.fasta");
-    copyFileIntoZip(zip, args.refPath, "inputs/ref.fasta");
-    copyFileIntoZip(zip, args.targetListPath, "inputs/target.fasta");
+    zip.addString("inputs/options.txt", renderArgs(args));
+    zip.addFile(args.indexPath, "inputs/index.fasta", ZipCompression::deflate);
+    zip.addFile(args.refPath, "inputs/ref.fasta", ZipCompression::deflate);
+    zip.addFile(args.targetListPath, "inputs/target.fasta", ZipCompression::deflate);
     if (args.backgroundMode == BackgroundMode::fromFile)
-        copyFileIntoZip(zip, args.backgroundListPath, "inputs/background.fasta");
+        zip.addFile(args.backgroundListPath, "inputs/background.fasta", ZipCompression::deflate);
 
     // Outputs
 
-    // Bowtie Index
-    copyFileIntoZip(zip, "/tmp/index.1.ebwt", "outputs/index/index.1.ebwt");
-    copyFileIntoZip(zip, "/tmp/index.2.ebwt", "outputs/index/index.2.ebwt");
-    copyFileIntoZip(zip, "/tmp/index.3.ebwt", "outputs/index/index.3.ebwt");
-    copyFileIntoZip(zip, "/tmp/index.4.ebwt", "outputs/index/index.4.ebwt");
-    copyFileIntoZip(zip, "/tmp/index.rev.1.ebwt", "outputs/index/index.rev.1.ebwt");
-    copyFileIntoZip(zip, "/tmp/index.rev.2.ebwt", "outputs/index/index.rev.2.ebwt");
+    // Bowtie Index (index.1.ebwt, ..., or .ebwtl for large indexes). Packed DNA and suffix array samples, which
+    // hardly compress.
+    if (args.includeIndexInWorkspace) {
+        const fs::path indexPath = s_bowtieIndexPath;
+        const std::string indexFilePrefix = indexPath.filename().string() + ".";
+        for (const fs::directory_entry& entry : fs::directory_iterator(indexPath.parent_path())) {
+            const std::string filename = entry.path().filename().string();
+            if (entry.is_regular_file() && filename.starts_with(indexFilePrefix))
+                zip.addFile(entry.path(), "outputs/index/" + filename, ZipCompression::store);
+        }
+    }
 
     // Inner
-    copyFileIntoZip(zip, "/tmp/Inner/NAME", "outputs/Inner/NAME");
-    copyFileIntoZip(zip, "/tmp/Inner/NAME_Inner.bowtie", "outputs/Inner/NAME_Inner.bowtie");
-    copyFileIntoZip(zip, "/tmp/Inner/NAME-common_list.txt", "outputs/Inner/NAME-common_list.txt");
-    copyFileIntoZip(zip, "/tmp/Inner/NAME-common.txt", "outputs/Inner/NAME-common.txt");
-    copyFileIntoZip(zip, "/tmp/Inner/NAME-specific.txt", "outputs/Inner/NAME-specific.txt");
+    zip.addFile("/tmp/Inner/NAME", "outputs/Inner/NAME", ZipCompression::deflate);
+    zip.addFile("/tmp/Inner/NAME-common_list.txt", "outputs/Inner/NAME-common_list.txt", ZipCompression::deflate);
+    zip.addFile("/tmp/Inner/NAME-common.txt", "outputs/Inner/NAME-common.txt", ZipCompression::deflate);
+    zip.addFile("/tmp/Inner/NAME-specific.txt", "outputs/Inner/NAME-specific.txt", ZipCompression::deflate);
 
     // Outer
-    copyFileIntoZip(zip, "/tmp/Outer/NAME", "outputs/Outer/NAME");
-    copyFileIntoZip(zip, "/tmp/Outer/NAME_Outer.bowtie", "outputs/Outer/NAME_Outer.bowtie");
-    copyFileIntoZip(zip, "/tmp/Outer/NAME-common.txt", "outputs/Outer/NAME-common.txt");
-    copyFileIntoZip(zip, "/tmp/Outer/NAME-specific.txt", "outputs/Outer/NAME-specific.txt");
+    zip.addFile("/tmp/Outer/NAME", "outputs/Outer/NAME", ZipCompression::deflate);
+    zip.addFile("/tmp/Outer/NAME-common.txt", "outputs/Outer/NAME-common.txt", ZipCompression::deflate);
+    zip.addFile("/tmp/Outer/NAME-specific.txt", "outputs/Outer/NAME-specific.txt", ZipCompression::deflate);
 
     // Loop
     if (args.includeLoopPrimers)
     {
-        copyFileIntoZip(zip, "/tmp/Loop/NAME", "outputs/Loop/NAME");
-        copyFileIntoZip(zip, "/tmp/Loop/NAME_Loop.bowtie", "outputs/Loop/NAME_Loop.bowtie");
-        copyFileIntoZip(zip, "/tmp/Loop/NAME-common.txt", "outputs/Loop/NAME-common.txt");
-        copyFileIntoZip(zip, "/tmp/Loop/NAME-specific.txt", "outputs/Loop/NAME-specific.txt");
+        zip.addFile("/tmp/Loop/NAME", "outputs/Loop/NAME", ZipCompression::deflate);
+        zip.addFile("/tmp/Loop/NAME-common.txt", "outputs/Loop/NAME-common.txt", ZipCompression::deflate);
+        zip.addFile("/tmp/Loop/NAME-specific.txt", "outputs/Loop/NAME-specific.txt", ZipCompression::deflate);
     }
 
-    copyFileIntoZip(zip, "success.txt", "outputs/success.txt");
+    zip.addFile("success.txt", "outputs/success.txt", ZipCompression::deflate);
 
     // Logs?!
 
-    zipClose(zip, nullptr);
+    zip.close();
 }
 
+// Arguments of the last successful run, for create_workspace_zip()
+static std::optional<Args> s_lastRunArgs;
+
+// Path and digest of the --index file hashed by compute_index_digest() for the next run, so it is only hashed once
+static std::optional<std::pair<std::string, std::string>> s_precomputedIndexDigest;
+
 static void runGlapd(const Args& args)
 {
-    buildBowtieIndex(args);
-    generateSingleRegionPrimers(args);
-    alignSingleRegionPrimers(args);
-    generateLampPrimerSets(args);
-    createWorkspaceZip(args);
+    // The module stays loaded between the jobs of the web worker. Only the phase memo carries over.
+    s_lastRunArgs.reset();
+    clearTrace();
+    setTracingEnabled(!args.tracePath.empty());
+
+    {
+        TraceScope trace("run");
+
+        const std::string indexDigest = s_precomputedIndexDigest && s_precomputedIndexDigest->first == args.indexPath
+            ? s_precomputedIndexDigest->second
+            : computeFileDigest(args.indexPath);
+        s_precomputedIndexDigest.reset();
+        const PhaseMemo::Keys keys = computePhaseKeys(args, indexDigest);
+
+        buildBowtieIndex(args, indexDigest, keys[PhaseMemo::bowtieIndex]);
+        generateSingleRegionPrimers(args, keys[PhaseMemo::singleRegionPrimers]);
+        alignSingleRegionPrimers(args, keys[PhaseMemo::alignment], keys[PhaseMemo::hitTables]);
+        generateLampPrimerSets(args, keys[PhaseMemo::lampPrimerSets]);
+
+        s_lastRunArgs = args;
+
+        if (!args.deferWorkspace)
+            createWorkspaceZip(args, zipFileWriter("workspace.zip"));
+    }
+
+    if (!args.tracePath.empty())
+        writeTrace(args.tracePath);
+}
+
+// Creates the workspace for the last successful run with --deferWorkspace. Called by the web worker when the user
+// asks for the workspace, so runs that end without it do not pay for it. The archive is handed to
+// notify_workspace_chunk() while it is written, instead of being kept in the in-memory file system.
+extern "C" EMSCRIPTEN_KEEPALIVE int create_workspace_zip()
+{
+    if (!s_lastRunArgs) {
+        std::printf("No run to create a workspace for\n");
+        return 1;
+    }
+
+    try {
+        createWorkspaceZip(*s_lastRunArgs, [](const unsigned char* data, size_t size) {
+            notify_workspace_chunk(data, size);
+            return true;
+        });
+        return 0;
+    } catch (const std::exception& e) {
+        std::printf("Unhandled exception: %s\n", e.what());
+        return 1;
+    }
+}
+
+// Returns the index cache key of the FASTA file at path. Called by the web worker before a run, so it can load just
+// that entry of the index cache from IndexedDB. Returns an empty string if the file cannot be read.
+extern "C" EMSCRIPTEN_KEEPALIVE const char* compute_index_digest(const char* path)
+{
+    try {
+        s_precomputedIndexDigest.emplace(path, computeFileDigest(path));
+        return s_precomputedIndexDigest->second.c_str();
+    } catch (const std::exception& e) {
+        std::printf("Unhandled exception: %s\n", e.what());
+        s_precomputedIndexDigest.reset();
+        return "";
+    }
 }
 
 static bool isValidFile(const std::string& path) {
@@ -387,17 +692,23 @@ static bool isValidFile(const std::string& path) {
 int main(int argc, char* argv[])
 {
     try {
-        s_parPath = getParPath();
-
         const Args args = parseArgs(argc, argv);
 
+        s_parPath = args.parPath.empty() ? getParPath() : args.parPath;
+
         // Verify arguments
+        if (!fs::is_directory(s_parPath))
+            die("Invalid par path");
         if (!isValidFile(args.indexPath))
             die("Invalid index path");
         if (!isValidFile(args.refPath))
             die("Invalid ref path");
         if (!args.targetListPath.empty() && !isValidFile(args.targetListPath))
             die("Invalid target list path");
+        if (args.maxNumMismatchesInBackground > 3)
+            die("Illegal value for --maxNumMismatchesInBackground, at most 3");
+        if (args.maxNumMismatchesInTarget > args.maxNumMismatchesInBackground)
+            die("--maxNumMismatchesInTarget must not be greater than --maxNumMismatchesInBackground");
         if (args.backgroundMode != BackgroundMode::fromFile) {
             if (!args.backgroundListPath.empty())
                 die("--backgroundListPath set, but --backgroundMode is not fromFile");
@@ -414,6 +725,10 @@ int main(int argc, char* argv[])
         std::printf("Done. Took %lli seconds in total\n", duration.count());
 
         return 0;
+    } catch (const ArgumentError& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        std::fflush(stderr);
+        return 1;
     } catch (const std::exception& e) {
         std::printf("Unhandled exception: %s\n", e.what());
         return 1;
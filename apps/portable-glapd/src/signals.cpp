@@ -32,6 +32,14 @@ void notify_about_to_start_phase(const char* phase)
 {
 }
 
+void notify_finished_phase(const char* phase, double seconds)
+{
+}
+
+void notify_workspace_chunk(const unsigned char* data, size_t size)
+{
+}
+
 }
 
 #endif
\ No newline at end of file
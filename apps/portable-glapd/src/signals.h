@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstddef>
+
 extern "C" {
 
 void notify_about_to_start_phase(const char* phase);
+void notify_finished_phase(const char* phase, double seconds);
+void notify_workspace_chunk(const unsigned char* data, size_t size);
 
 } // extern "C"
\ No newline at end of file
@@ -4,5 +4,22 @@ addToLibrary({
             'cmd': 'notify_about_to_start_phase',
             'phase': UTF8ToString(phase),
         });
+    },
+
+    notify_finished_phase: function(phase, seconds) {
+        postMessage({
+            'cmd': 'notify_finished_phase',
+            'phase': UTF8ToString(phase),
+            'seconds': seconds,
+        });
+    },
+
+    notify_workspace_chunk: function(data, size) {
+        // Copied out of the shared heap, so it can be transferred
+        const chunk = HEAPU8.slice(data, data + size);
+        postMessage({
+            'cmd': 'workspaceChunk',
+            'chunk': chunk,
+        }, [chunk.buffer]);
     }
 });
\ No newline at end of file
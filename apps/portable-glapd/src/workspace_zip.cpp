@@ -0,0 +1,312 @@
+#include "workspace_zip.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include "thread_pool.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr size_t blockSize = 1024 * 1024; // 1 MB
+constexpr size_t dictionarySize = 32 * 1024; // deflate window
+constexpr size_t streamBufferSize = 4 * 1024 * 1024; // 4 MB, the writer gets few large chunks
+
+// General purpose flag: CRC and sizes follow the data in a data descriptor
+constexpr uLong dataDescriptorFlag = 1 << 3;
+constexpr uint32_t dataDescriptorSignature = 0x08074b50;
+
+struct Block {
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> dictionary; // the end of the previous block
+    bool last = false;
+};
+
+struct CompressedBlock {
+    std::vector<unsigned char> data;
+    uLong uncompressedSize;
+    uLong crc;
+};
+
+CompressedBlock compressBlock(const Block& block, int level) {
+    z_stream stream = {};
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("Could not initialize deflate");
+
+    if (!block.dictionary.empty())
+        deflateSetDictionary(&stream, block.dictionary.data(), block.dictionary.size());
+
+    CompressedBlock result;
+    result.uncompressedSize = block.data.size();
+    result.crc = crc32(0, block.data.data(), block.data.size());
+
+    // Non-final blocks end byte-aligned, without the final-block bit, so the next block can be appended
+    result.data.resize(deflateBound(&stream, block.data.size()) + 16);
+    stream.next_in = const_cast<Bytef*>(block.data.data());
+    stream.avail_in = block.data.size();
+    stream.next_out = result.data.data();
+    stream.avail_out = result.data.size();
+    const int ret = ::deflate(&stream, block.last ? Z_FINISH : Z_SYNC_FLUSH);
+    result.data.resize(result.data.size() - stream.avail_out);
+    deflateEnd(&stream);
+
+    if (ret != (block.last ? Z_STREAM_END : Z_OK))
+        throw std::runtime_error("Could not deflate block");
+
+    return result;
+}
+
+void putUint32(unsigned char* dst, uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+        dst[i] = static_cast<unsigned char>(value >> (8 * i));
+}
+
+void putUint64(unsigned char* dst, uint64_t value) {
+    putUint32(dst, static_cast<uint32_t>(value));
+    putUint32(dst + 4, static_cast<uint32_t>(value >> 32));
+}
+
+} // namespace
+
+ZipWriter zipFileWriter(const std::string& path) {
+    auto file = std::make_shared<std::ofstream>(path, std::ios::binary);
+    if (!*file)
+        throw std::runtime_error("Cannot create zip file: " + path);
+
+    return [file](const unsigned char* data, size_t size) {
+        file->write(reinterpret_cast<const char*>(data), size);
+        return file->good();
+    };
+}
+
+// minizip I/O that only appends. minizip seeks back to fill in the CRC and sizes of a member's local header after
+// writing its data. These writes are dropped, since the header may already have gone to the writer; the values are
+// in the member's data descriptor.
+class WorkspaceZip::Stream {
+public:
+    explicit Stream(ZipWriter writer)
+        : m_writer(std::move(writer))
+    {
+        m_buffer.reserve(streamBufferSize);
+    }
+
+    zlib_filefunc64_def fileFunctions() {
+        zlib_filefunc64_def functions = {};
+        functions.zopen64_file = [](voidpf opaque, const void*, int) -> voidpf { return opaque; };
+        functions.zread_file = [](voidpf, voidpf, void*, uLong) -> uLong { return 0; };
+        functions.zwrite_file = [](voidpf, voidpf stream, const void* buf, uLong size) -> uLong {
+            return static_cast<Stream*>(stream)->write(buf, size);
+        };
+        functions.ztell64_file = [](voidpf, voidpf stream) -> ZPOS64_T {
+            return static_cast<Stream*>(stream)->m_position;
+        };
+        functions.zseek64_file = [](voidpf, voidpf stream, ZPOS64_T offset, int origin) -> long {
+            return static_cast<Stream*>(stream)->seek(offset, origin);
+        };
+        functions.zclose_file = [](voidpf, voidpf stream) -> int {
+            return static_cast<Stream*>(stream)->flush() ? 0 : -1;
+        };
+        functions.zerror_file = [](voidpf, voidpf stream) -> int {
+            return static_cast<Stream*>(stream)->m_failed ? 1 : 0;
+        };
+        functions.opaque = this;
+        return functions;
+    }
+
+    uint64_t position() const { return m_position; }
+    bool failed() const { return m_failed; }
+
+    void append(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+        m_end += size;
+        m_position = m_end;
+        if (m_buffer.size() >= streamBufferSize)
+            flush();
+    }
+
+    bool flush() {
+        if (!m_buffer.empty() && !m_failed && !m_writer(m_buffer.data(), m_buffer.size()))
+            m_failed = true;
+        m_buffer.clear();
+        return !m_failed;
+    }
+
+private:
+    uLong write(const void* data, uLong size) {
+        if (m_position == m_end) {
+            append(data, size);
+            return m_failed ? 0 : size;
+        }
+
+        // Update of a local header
+        if (m_position + size > m_end)
+            return 0;
+        m_position += size;
+        return size;
+    }
+
+    long seek(ZPOS64_T offset, int origin) {
+        uint64_t position;
+        switch (origin) {
+        case ZLIB_FILEFUNC_SEEK_SET: position = offset; break;
+        case ZLIB_FILEFUNC_SEEK_CUR: position = m_position + offset; break;
+        case ZLIB_FILEFUNC_SEEK_END: position = m_end + offset; break;
+        default: return -1;
+        }
+        if (position > m_end)
+            return -1;
+        m_position = position;
+        return 0;
+    }
+
+private:
+    ZipWriter m_writer;
+    std::vector<unsigned char> m_buffer;
+    uint64_t m_position = 0;
+    uint64_t m_end = 0;
+    bool m_failed = false;
+};
+
+WorkspaceZip::WorkspaceZip(ZipWriter writer, ThreadPool& threadPool, int deflateLevel)
+    : m_stream(std::make_unique<Stream>(std::move(writer)))
+    , m_threadPool(threadPool)
+    , m_deflateLevel(deflateLevel)
+{
+    zlib_filefunc64_def fileFunctions = m_stream->fileFunctions();
+    m_zip = zipOpen2_64("", APPEND_STATUS_CREATE, nullptr, &fileFunctions);
+    if (!m_zip)
+        throw std::runtime_error("Cannot create zip file");
+}
+
+WorkspaceZip::~WorkspaceZip() {
+    if (m_zip)
+        zipClose(m_zip, nullptr);
+}
+
+void WorkspaceZip::addFile(const fs::path& src, const fs::path& dst, ZipCompression compression) {
+    if (compression == ZipCompression::store) {
+        store(src, dst);
+        return;
+    }
+
+    std::ifstream in(src, std::ios::binary);
+    deflate(in, dst);
+}
+
+void WorkspaceZip::addString(const fs::path& dst, const std::string& contents) {
+    std::istringstream in(contents);
+    deflate(in, dst);
+}
+
+void WorkspaceZip::close() {
+    const int ret = zipClose(m_zip, nullptr);
+    m_zip = nullptr;
+    if (ret != ZIP_OK || m_stream->failed())
+        throw std::runtime_error("Could not write zip file");
+}
+
+void WorkspaceZip::store(const fs::path& src, const fs::path& dst) {
+    openMember(dst, 0, 0);
+
+    std::ifstream in(src, std::ios::binary);
+    std::unique_ptr<char[]> buf = std::make_unique<char[]>(blockSize);
+    uint64_t size = 0;
+    uLong crc = crc32(0, nullptr, 0);
+    while (in) {
+        in.read(buf.get(), blockSize);
+        const size_t numRead = in.gcount();
+        checkZipResult(zipWriteInFileInZip(m_zip, buf.get(), numRead), dst);
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(buf.get()), numRead);
+        size += numRead;
+    }
+
+    checkZipResult(zipCloseFileInZip(m_zip), dst);
+    writeDataDescriptor(crc, size);
+}
+
+void WorkspaceZip::deflate(std::istream& in, const fs::path& dst) {
+    // Raw mode: we hand minizip the finished deflate stream, and the size and CRC at the end
+    openMember(dst, Z_DEFLATED, 1);
+
+    std::deque<std::future<CompressedBlock>> pendingBlocks;
+    const size_t maxNumPendingBlocks = 2 * m_threadPool.size();
+    uint64_t uncompressedSize = 0;
+    uLong crc = crc32(0, nullptr, 0);
+
+    auto writeBlock = [&] {
+        const CompressedBlock block = pendingBlocks.front().get();
+        pendingBlocks.pop_front();
+
+        checkZipResult(zipWriteInFileInZip(m_zip, block.data.data(), block.data.size()), dst);
+        crc = crc32_combine(crc, block.crc, block.uncompressedSize);
+        uncompressedSize += block.uncompressedSize;
+    };
+
+    std::vector<unsigned char> dictionary;
+    bool last = false;
+    while (!last) {
+        Block block;
+        block.data.resize(blockSize);
+        in.read(reinterpret_cast<char*>(block.data.data()), blockSize);
+        block.data.resize(in.gcount());
+        last = block.data.size() < blockSize || in.peek() == std::char_traits<char>::eof();
+        block.last = last;
+
+        block.dictionary = std::move(dictionary);
+        dictionary.assign(block.data.end() - std::min(block.data.size(), dictionarySize), block.data.end());
+
+        pendingBlocks.push_back(m_threadPool.submit([block = std::move(block), level = m_deflateLevel] {
+            return compressBlock(block, level);
+        }));
+
+        while (pendingBlocks.size() > maxNumPendingBlocks)
+            writeBlock();
+    }
+
+    while (!pendingBlocks.empty())
+        writeBlock();
+
+    checkZipResult(zipCloseFileInZipRaw64(m_zip, uncompressedSize, crc), dst);
+    writeDataDescriptor(crc, uncompressedSize);
+}
+
+void WorkspaceZip::openMember(const fs::path& dst, int method, int raw) {
+    const int level = method == Z_DEFLATED ? m_deflateLevel : 0;
+    // Always zip64, since the size is not known up front, and a Bowtie index or an input FASTA can exceed 4 GB
+    const int ret = zipOpenNewFileInZip4_64(m_zip, dst.string().c_str(), nullptr, nullptr, 0, nullptr, 0, nullptr,
+        method, level, raw, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY, nullptr, 0, 0, dataDescriptorFlag, 1);
+    checkZipResult(ret, dst);
+
+    // minizip writes the local header right away, and buffers the data
+    m_memberDataBegin = m_stream->position();
+}
+
+void WorkspaceZip::writeDataDescriptor(uLong crc, uint64_t uncompressedSize) {
+    // zipCloseFileInZip has flushed the data and returned to the end of the archive
+    const uint64_t compressedSize = m_stream->position() - m_memberDataBegin;
+
+    // The zip64 layout, with 8-byte sizes, as the local header has a zip64 extra field
+    unsigned char descriptor[24];
+    putUint32(descriptor, dataDescriptorSignature);
+    putUint32(descriptor + 4, crc);
+    putUint64(descriptor + 8, compressedSize);
+    putUint64(descriptor + 16, uncompressedSize);
+    m_stream->append(descriptor, sizeof(descriptor));
+}
+
+void WorkspaceZip::checkZipResult(int ret, const fs::path& dst) {
+    if (ret != ZIP_OK || m_stream->failed())
+        throw std::runtime_error("Could not add " + dst.string() + " to the zip file");
+}
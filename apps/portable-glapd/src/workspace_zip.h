@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <zip.h>
+
+class ThreadPool;
+
+enum class ZipCompression {
+    store,   // for data that does not compress well, e.g. Bowtie indexes
+    deflate,
+};
+
+// Receives the archive in order while it is written. Returns false on failure.
+using ZipWriter = std::function<bool(const unsigned char* data, size_t size)>;
+
+// Writes to a file, for the archive on disk
+ZipWriter zipFileWriter(const std::string& path);
+
+// Zip archive writer that deflates members in blocks on a thread pool, like pigz.
+//
+// Each block is compressed on its own, primed with the end of the previous block as dictionary, and the raw deflate
+// streams are concatenated. The result is a regular deflate stream, so any unzip can read it.
+//
+// The archive is written strictly in order, so it can be streamed out while it is created: members end with a data
+// descriptor instead of having their local header updated.
+class WorkspaceZip {
+public:
+    WorkspaceZip(ZipWriter writer, ThreadPool& threadPool, int deflateLevel);
+    ~WorkspaceZip();
+
+    WorkspaceZip(const WorkspaceZip&) = delete;
+    WorkspaceZip& operator=(const WorkspaceZip&) = delete;
+
+    // A missing src results in an empty member
+    void addFile(const std::filesystem::path& src, const std::filesystem::path& dst, ZipCompression compression);
+    void addString(const std::filesystem::path& dst, const std::string& contents);
+
+    void close();
+
+private:
+    void store(const std::filesystem::path& src, const std::filesystem::path& dst);
+    void deflate(std::istream& in, const std::filesystem::path& dst);
+    void openMember(const std::filesystem::path& dst, int method, int raw);
+    void writeDataDescriptor(uLong crc, uint64_t uncompressedSize);
+    void checkZipResult(int ret, const std::filesystem::path& dst);
+
+private:
+    class Stream;
+
+    std::unique_ptr<Stream> m_stream;
+    zipFile m_zip;
+    uint64_t m_memberDataBegin = 0;
+    ThreadPool& m_threadPool;
+    int m_deflateLevel;
+};
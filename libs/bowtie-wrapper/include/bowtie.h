@@ -1,8 +1,127 @@
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 extern "C" {
 
 int bowtie_build(int argc, const char* argv[]);
 int bowtie(int argc, const char* argv[]);
 
-}
\ No newline at end of file
+}
+
+// One alignment as reported by bowtie with `--suppress 5,6,7`.
+//
+// All views are only valid for the duration of the callback, except refName, which stays valid until bowtieAlign
+// returns.
+//
+// Without `--refidx`, refIndex numbers the references densely. With it, bowtie reports references by their index in the
+// bowtie index instead of by name, so refIndex is that index and refName is empty, except for hits from
+// BowtieIndex::align, which fills it in.
+struct BowtieHit {
+    std::string_view readName;
+    char strand = '+';
+    unsigned refIndex = 0; // without --refidx, in order of first appearance within one bowtieAlign call
+    std::string_view refName;
+    unsigned refOffset = 0;
+    std::span<const unsigned> mismatchPositions; // relative to the 5' end of the read
+};
+
+using BowtieHitCallback = std::function<void(const BowtieHit& hit)>;
+
+// Runs bowtie and hands every alignment to onHit instead of writing it to a file.
+//
+// argv must not contain an output path, and must request the `--suppress 5,6,7` output format. onHit is called one hit
+// at a time while bowtie is still aligning, on the calling thread natively and on the main thread under Emscripten,
+// where bowtie's output goes through the file system. Returns the exit code of bowtie.
+//
+// May be called from several threads at once. Natively, bowtie runs in a child process, so concurrent calls align in
+// parallel. Under Emscripten, they take turns.
+int bowtieAlign(int argc, const char* argv[], const BowtieHitCallback& onHit);
+
+// Turns chunks of bowtie output into BowtieHits.
+//
+// Lines are parsed in place wherever possible, so apart from the first occurrence of each reference name, parsing
+// does not allocate. With refIndicesOnly, for output of bowtie with `--refidx`, references are not looked up at all.
+class BowtieOutputParser {
+public:
+    explicit BowtieOutputParser(BowtieHitCallback onHit, bool refIndicesOnly = false)
+        : m_onHit(std::move(onHit)), m_refIndicesOnly(refIndicesOnly) {}
+
+    // Parses all complete lines in data. A trailing incomplete line is kept until the next call.
+    void feed(const char* data, size_t size);
+
+    // Parses a trailing line without a newline, if any
+    void finish();
+
+    // Parses a single line without its newline. Returns false if it is not a valid hit.
+    bool parseLine(std::string_view line, BowtieHit& hit);
+
+private:
+    struct StringHash {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    void processLine(std::string_view line);
+    unsigned getRefIndex(std::string_view refName, std::string_view& stableRefName);
+
+private:
+    BowtieHitCallback m_onHit;
+    bool m_refIndicesOnly;
+
+    std::string m_pendingLine;
+    std::vector<unsigned> m_mismatchPositions;
+    std::unordered_map<std::string, unsigned, StringHash, std::equal_to<>> m_refIndices;
+};
+
+// A bowtie index that stays resident in memory for as long as a handle to it exists.
+//
+// Natively, the index files are memory-mapped once and bowtie maps the same pages with `--mm`, so repeated and
+// concurrent alignments against one index neither read nor deserialize it again. Under Emscripten, bowtie still loads
+// the index for every alignment.
+class BowtieIndex {
+public:
+    // Returns the handle for the index at path, opening it if no handle to it exists yet
+    static std::shared_ptr<const BowtieIndex> open(const std::string& path);
+
+    ~BowtieIndex();
+
+    BowtieIndex(const BowtieIndex&) = delete;
+    BowtieIndex& operator=(const BowtieIndex&) = delete;
+
+    const std::string& getPath() const { return m_path; }
+
+    // The names of the references, by their index, as bowtie reports them. Read from the index files when opening it,
+    // and empty if they have an unexpected layout.
+    const std::vector<std::string>& getRefNames() const { return m_refNames; }
+
+    // Like bowtieAlign, with argv holding only options. Appends the index and readsPath. Safe to call from several
+    // threads at once.
+    //
+    // If the reference names are known, runs bowtie with `--refidx`, and every hit's refIndex is its index in
+    // getRefNames() and its refName stays valid for as long as this index.
+    int align(int argc, const char* argv[], const std::string& readsPath, const BowtieHitCallback& onHit) const;
+
+private:
+    explicit BowtieIndex(std::string path);
+
+private:
+    struct Mapping {
+        void* data;
+        size_t size;
+    };
+
+    std::string m_path;
+    std::vector<Mapping> m_mappings;
+    std::vector<std::string> m_refNames;
+};
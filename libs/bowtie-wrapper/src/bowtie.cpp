@@ -0,0 +1,470 @@
+#include "bowtie.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <trace.h>
+
+#ifndef EMSCRIPTEN
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#else
+#include <emscripten.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr size_t readBufferSize = 1024 * 1024; // 1 MB
+
+bool hasArg(int argc, const char* argv[], const char* arg) {
+    return std::any_of(argv, argv + argc, [arg](const char* a) { return std::strcmp(a, arg) == 0; });
+}
+
+// Reads the reference names that bowtie-build stores at the end of the primary index file, after a header, the
+// reference lengths, the BWT and its lookup tables. offSize is the size of an offset, 4 bytes for .ebwt files and 8 for
+// .ebwtl files. Returns no names if the file does not have the expected layout.
+std::vector<std::string> readRefNames(std::istream& in, size_t offSize) {
+    bool bigEndian = false;
+    auto readUint = [&](size_t size) {
+        unsigned char bytes[8] = {};
+        in.read(reinterpret_cast<char*>(bytes), size);
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; i++)
+            value |= uint64_t(bytes[i]) << (8 * (bigEndian ? size - 1 - i : i));
+        return value;
+    };
+    auto skip = [&](uint64_t size) { in.seekg(size, std::ios::cur); };
+
+    // Written in the byte order of the machine that built the index, unless built with --big
+    const uint64_t endiannessHint = readUint(4);
+    if (endiannessHint == 0x01000000)
+        bigEndian = true;
+    else if (endiannessHint != 1)
+        return {};
+
+    const uint64_t len = readUint(offSize);
+    const uint64_t lineRate = readUint(4);
+    const uint64_t linesPerSide = readUint(4);
+    readUint(4); // offRate
+    const uint64_t ftabChars = readUint(4);
+    readUint(4); // flags
+    if (!in || lineRate < 2 || lineRate > 16 || linesPerSide == 0 || linesPerSide > 16 || ftabChars == 0 || ftabChars > 16)
+        return {};
+
+    const uint64_t numRefs = readUint(offSize);
+    skip(numRefs * offSize); // lengths
+    const uint64_t numFragments = readUint(offSize);
+    skip(numFragments * 3 * offSize);
+
+    // The BWT is stored in pairs of sides, each packing 4 characters per byte followed by two occurrence counts
+    const uint64_t bwtSize = len / 4 + 1;
+    const uint64_t sideSize = (uint64_t(1) << lineRate) * linesPerSide;
+    if (sideSize <= 2 * offSize)
+        return {};
+    const uint64_t sideBwtSize = sideSize - 2 * offSize;
+    const uint64_t numSidePairs = (bwtSize + 2 * sideBwtSize - 1) / (2 * sideBwtSize);
+    skip(numSidePairs * 2 * sideSize);
+
+    readUint(offSize); // offset of the '$'
+    uint64_t fchr[5];
+    for (uint64_t& count : fchr)
+        count = readUint(offSize);
+    // Cumulative character counts, a cheap check that the BWT size was right
+    if (!in || fchr[0] != 0 || !std::is_sorted(std::begin(fchr), std::end(fchr)) || fchr[4] < len || fchr[4] > len + 1)
+        return {};
+    skip(((uint64_t(1) << (2 * ftabChars)) + 1 + 2 * ftabChars) * offSize); // ftab and eftab
+
+    // One name per line, then a '\0'
+    const std::string text { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+    if (text.empty() || text.back() != '\0')
+        return {};
+
+    std::vector<std::string> names;
+    size_t lineBegin = 0;
+    while (lineBegin + 1 < text.size()) {
+        const size_t lineEnd = text.find('\n', lineBegin);
+        if (lineEnd == std::string::npos || names.size() == numRefs)
+            return {};
+        // bowtie reports names up to the first whitespace, unless run with --fullref
+        const std::string_view line = std::string_view(text).substr(lineBegin, lineEnd - lineBegin);
+        names.emplace_back(line.substr(0, line.find_first_of(" \t\r")));
+        lineBegin = lineEnd + 1;
+    }
+    if (names.size() != numRefs)
+        return {};
+
+    return names;
+}
+
+std::vector<std::string> readRefNames(const std::string& indexPath) {
+    for (const char* suffix : { ".1.ebwt", ".1.ebwtl" }) {
+        std::ifstream file(indexPath + suffix, std::ios::binary);
+        if (file)
+            return readRefNames(file, suffix == std::string_view(".1.ebwt") ? 4 : 8);
+    }
+    return {};
+}
+
+} // namespace
+
+void BowtieOutputParser::feed(const char* data, size_t size) {
+    const char* end = data + size;
+
+    if (!m_pendingLine.empty()) {
+        const char* newline = static_cast<const char*>(std::memchr(data, '\n', size));
+        if (!newline) {
+            m_pendingLine.append(data, size);
+            return;
+        }
+        m_pendingLine.append(data, newline);
+        processLine(m_pendingLine);
+        m_pendingLine.clear();
+        data = newline + 1;
+    }
+
+    while (data < end) {
+        const char* newline = static_cast<const char*>(std::memchr(data, '\n', end - data));
+        if (!newline) {
+            m_pendingLine.assign(data, end);
+            return;
+        }
+        processLine(std::string_view(data, newline));
+        data = newline + 1;
+    }
+}
+
+void BowtieOutputParser::finish() {
+    if (!m_pendingLine.empty())
+        processLine(m_pendingLine);
+    m_pendingLine.clear();
+}
+
+void BowtieOutputParser::processLine(std::string_view line) {
+    BowtieHit hit;
+    if (parseLine(line, hit))
+        m_onHit(hit);
+}
+
+bool BowtieOutputParser::parseLine(std::string_view line, BowtieHit& hit) {
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+
+    // Fields: read name, strand, reference name, offset, mismatches
+    std::string_view fields[5];
+    size_t numFields = 0;
+    while (numFields < 5) {
+        const size_t tab = line.find('\t');
+        fields[numFields++] = line.substr(0, tab);
+        if (tab == std::string_view::npos)
+            break;
+        line.remove_prefix(tab + 1);
+    }
+    if (numFields < 5 || fields[1].empty())
+        return false;
+
+    hit.readName = fields[0];
+    hit.strand = fields[1][0];
+    const char* offsetEnd = fields[3].data() + fields[3].size();
+    if (std::from_chars(fields[3].data(), offsetEnd, hit.refOffset).ptr != offsetEnd)
+        return false;
+
+    // Mismatch descriptors look like `12:A>G,3:C>T`
+    m_mismatchPositions.clear();
+    const char* p = fields[4].data();
+    const char* end = p + fields[4].size();
+    while (p < end) {
+        unsigned pos = 0;
+        const auto [ptr, ec] = std::from_chars(p, end, pos);
+        if (ec == std::errc() && ptr < end && *ptr == ':')
+            m_mismatchPositions.push_back(pos);
+
+        p = static_cast<const char*>(std::memchr(ptr, ',', end - ptr));
+        if (!p)
+            break;
+        ++p;
+    }
+    hit.mismatchPositions = m_mismatchPositions;
+
+    if (m_refIndicesOnly) {
+        const char* refEnd = fields[2].data() + fields[2].size();
+        const auto [ptr, ec] = std::from_chars(fields[2].data(), refEnd, hit.refIndex);
+        if (fields[2].empty() || ec != std::errc() || ptr != refEnd)
+            return false;
+        hit.refName = {};
+    } else {
+        hit.refIndex = getRefIndex(fields[2], hit.refName);
+    }
+
+    return true;
+}
+
+unsigned BowtieOutputParser::getRefIndex(std::string_view refName, std::string_view& stableRefName) {
+    auto it = m_refIndices.find(refName);
+    if (it == m_refIndices.end())
+        it = m_refIndices.emplace(std::string(refName), static_cast<unsigned>(m_refIndices.size())).first;
+
+    // Node-based container, so the key does not move
+    stableRefName = it->first;
+    return it->second;
+}
+
+#ifndef EMSCRIPTEN
+
+// Creating the pipe and starting bowtie happen together, so no other child inherits the write end and keeps the pipe
+// open
+static std::mutex s_spawnMutex;
+
+int bowtieAlign(int argc, const char* argv[], const BowtieHitCallback& onHit) {
+    TraceScope trace("bowtie process");
+
+    // bowtie keeps its options in globals, so it runs as a process of its own, the bowtie-align executable. That way
+    // concurrent calls align in parallel. Its output goes into a pipe, which is parsed while it is still aligning.
+    int fds[2];
+    pid_t pid;
+    {
+        std::lock_guard lock(s_spawnMutex);
+
+        if (pipe(fds) != 0)
+            throw std::system_error(errno, std::generic_category(), "Could not create pipe for bowtie output");
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+        // bowtie writes the hits to stdout if not given an output path
+        posix_spawn_file_actions_t fileActions;
+        posix_spawn_file_actions_init(&fileActions);
+        posix_spawn_file_actions_adddup2(&fileActions, fds[1], STDOUT_FILENO);
+
+        std::vector<char*> args;
+        for (int i = 0; i < argc; i++)
+            args.push_back(const_cast<char*>(argv[i]));
+        args.push_back(nullptr);
+
+        const int error = posix_spawn(&pid, BOWTIE_ALIGN_PATH, &fileActions, nullptr, args.data(), environ);
+        posix_spawn_file_actions_destroy(&fileActions);
+        close(fds[1]);
+        if (error != 0) {
+            close(fds[0]);
+            throw std::system_error(error, std::generic_category(), "Could not start " BOWTIE_ALIGN_PATH);
+        }
+    }
+
+    BowtieOutputParser parser(onHit, hasArg(argc, argv, "--refidx"));
+    std::exception_ptr error;
+    std::unique_ptr<char[]> buf = std::make_unique<char[]>(readBufferSize);
+    while (true) {
+        const ssize_t numRead = read(fds[0], buf.get(), readBufferSize);
+        if (numRead < 0 && errno == EINTR)
+            continue;
+        if (numRead <= 0)
+            break;
+
+        // Keep draining after an error, otherwise bowtie blocks on a full pipe
+        if (error)
+            continue;
+
+        try {
+            parser.feed(buf.get(), numRead);
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    close(fds[0]);
+
+    // The child's memory and I/O do not show up in this process's usage, so they are added to the trace separately.
+    // Its I/O counters can only be read before it is reaped.
+    ChildProcessUsage childUsage;
+    if (isTracingEnabled()) {
+        siginfo_t info;
+        while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) {}
+        readProcessIo(pid, childUsage.bytesRead, childUsage.bytesWritten);
+    }
+
+    int status = 0;
+    rusage usage = {};
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {}
+    childUsage.peakMemoryBytes = uint64_t(usage.ru_maxrss) * 1024; // KB on Linux
+    trace.addChildProcessUsage(childUsage);
+
+    if (error)
+        std::rethrow_exception(error);
+
+    parser.finish();
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+#else
+
+// bowtie keeps its options in globals, so calls have to take turns
+static std::mutex s_bowtieMutex;
+
+// Where bowtie writes its output, a character device that hands it to bowtie_output_write
+static const char* const s_outputDevicePath = "/dev/bowtie-hits";
+
+// Parser of the call in progress, and the first error it threw
+static BowtieOutputParser* s_outputParser = nullptr;
+static std::exception_ptr s_outputError;
+
+// Called by the output device for every write of bowtie. The file system runs on the main thread, so writes of bowtie's
+// threads arrive there, one after the other.
+extern "C" EMSCRIPTEN_KEEPALIVE void bowtie_output_write(const char* data, size_t size) {
+    if (!s_outputParser || s_outputError)
+        return;
+
+    try {
+        s_outputParser->feed(data, size);
+    } catch (...) {
+        s_outputError = std::current_exception();
+    }
+}
+
+int bowtieAlign(int argc, const char* argv[], const BowtieHitCallback& onHit) {
+    std::lock_guard lock(s_bowtieMutex);
+
+    // No processes to run bowtie in, and a file would keep all hits in memory, so its output goes through a device
+    // and is parsed while it is still aligning
+    static std::once_flag s_outputDeviceCreated;
+    std::call_once(s_outputDeviceCreated, [] {
+        MAIN_THREAD_EM_ASM({
+            const dev = FS.makedev(64, 0);
+            FS.registerDevice(dev, {
+                write: (stream, buffer, offset, length) => {
+                    // Writes come straight from the WASM heap, so offset is the address of the data
+                    if (buffer.buffer !== HEAP8.buffer)
+                        throw new FS.ErrnoError(29); // EIO
+                    _bowtie_output_write(offset, length);
+                    return length;
+                },
+            });
+            FS.mkdev(UTF8ToString($0), dev);
+        }, s_outputDevicePath);
+    });
+
+    BowtieOutputParser parser(onHit, hasArg(argc, argv, "--refidx"));
+    s_outputParser = &parser;
+    s_outputError = nullptr;
+    struct ParserReset {
+        ~ParserReset() { s_outputParser = nullptr; }
+    } parserReset;
+
+    std::vector<const char*> args(argv, argv + argc);
+    args.push_back(s_outputDevicePath);
+    const int exitCode = bowtie(args.size(), args.data());
+
+    if (s_outputError)
+        std::rethrow_exception(std::exchange(s_outputError, nullptr));
+
+    parser.finish();
+
+    return exitCode;
+}
+
+#endif
+
+std::shared_ptr<const BowtieIndex> BowtieIndex::open(const std::string& path) {
+    static std::mutex s_mutex;
+    static std::unordered_map<std::string, std::weak_ptr<const BowtieIndex>> s_openIndexes;
+
+    std::lock_guard lock(s_mutex);
+
+    std::weak_ptr<const BowtieIndex>& entry = s_openIndexes[path];
+    std::shared_ptr<const BowtieIndex> index = entry.lock();
+    if (!index) {
+        index = std::shared_ptr<const BowtieIndex>(new BowtieIndex(path));
+        entry = index;
+    }
+    return index;
+}
+
+BowtieIndex::BowtieIndex(std::string path)
+    : m_path(std::move(path))
+{
+#ifndef EMSCRIPTEN
+    // Map the files bowtie reads (index.1.ebwt, ..., index.rev.2.ebwt, or .ebwtl for large indexes) and keep them
+    // mapped, so their pages stay in the page cache for bowtie to map
+    for (const char* extension : { ".ebwt", ".ebwtl" }) {
+        for (const char* part : { ".1", ".2", ".3", ".4", ".rev.1", ".rev.2" }) {
+            const std::string filePath = m_path + part + extension;
+            std::error_code ec;
+            if (!fs::is_regular_file(filePath, ec))
+                continue;
+
+            const int fd = ::open(filePath.c_str(), O_RDONLY);
+            if (fd < 0)
+                continue;
+
+            const size_t size = fs::file_size(filePath, ec);
+            void* data = !ec && size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (data == MAP_FAILED)
+                continue;
+
+            madvise(data, size, MADV_WILLNEED);
+            m_mappings.push_back({ data, size });
+        }
+    }
+
+    if (m_mappings.empty())
+        throw std::runtime_error("Cannot open Bowtie index: " + m_path);
+#endif
+
+    m_refNames = readRefNames(m_path);
+}
+
+BowtieIndex::~BowtieIndex() {
+#ifndef EMSCRIPTEN
+    for (const Mapping& mapping : m_mappings)
+        munmap(mapping.data, mapping.size);
+#endif
+}
+
+int BowtieIndex::align(int argc, const char* argv[], const std::string& readsPath, const BowtieHitCallback& onHit) const {
+    std::vector<const char*> args(argv, argv + argc);
+#ifndef EMSCRIPTEN
+    args.push_back("--mm");
+#endif
+    if (m_refNames.empty()) {
+        args.push_back(m_path.c_str());
+        args.push_back(readsPath.c_str());
+        return bowtieAlign(args.size(), args.data(), onHit);
+    }
+
+    // bowtie reports references by their index, so hits neither print nor look up names
+    args.push_back("--refidx");
+    args.push_back(m_path.c_str());
+    args.push_back(readsPath.c_str());
+    return bowtieAlign(args.size(), args.data(), [&](const BowtieHit& hit) {
+        // readRefNames disagrees with bowtie. Dropping the hit would lose alignments without notice.
+        if (hit.refIndex >= m_refNames.size()) {
+            throw std::runtime_error("bowtie reported reference " + std::to_string(hit.refIndex) + " of Bowtie index "
+                + m_path + ", which has " + std::to_string(m_refNames.size()) + " references");
+        }
+        BowtieHit namedHit = hit;
+        namedHit.refName = m_refNames[hit.refIndex];
+        onHit(namedHit);
+    });
+}
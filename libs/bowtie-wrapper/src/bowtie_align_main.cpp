@@ -0,0 +1,6 @@
+#include "bowtie.h"
+
+// bowtie as an executable, which bowtieAlign starts for every alignment
+int main(int argc, char* argv[]) {
+    return bowtie(argc, const_cast<const char**>(argv));
+}
@@ -0,0 +1,202 @@
+#include "packed_sequence.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr uint8_t notACGT = 0xff;
+constexpr size_t basesPerWord = 32;
+
+// Maps A, C, G, T (either case) to their 2 bit code, everything else to notACGT
+constexpr std::array<uint8_t, 256> makeBaseCodes() {
+    std::array<uint8_t, 256> codes = {};
+    for (uint8_t& code : codes)
+        code = notACGT;
+    codes['A'] = codes['a'] = 0;
+    codes['C'] = codes['c'] = 1;
+    codes['G'] = codes['g'] = 2;
+    codes['T'] = codes['t'] = 3;
+    return codes;
+}
+
+constexpr std::array<uint8_t, 256> baseCodes = makeBaseCodes();
+constexpr char codeBases[] = { 'A', 'C', 'G', 'T' };
+
+bool isTrimmed(char c) {
+    return c == '\r' || c == '\n' || c == ' ';
+}
+
+// Read-only view of a whole file, memory-mapped
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file: " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot open file: " + path);
+        }
+
+        m_size = st.st_size;
+        if (m_size > 0) {
+            m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m_data == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Cannot map file: " + path);
+            }
+            madvise(m_data, m_size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (m_size > 0)
+            munmap(m_data, m_size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view contents() const {
+        return m_size > 0 ? std::string_view(static_cast<const char*>(m_data), m_size) : std::string_view();
+    }
+
+private:
+    void* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+} // namespace
+
+namespace {
+
+// Appends the sequence lines of FASTA text that ends at a line break or at the end of the file
+void appendFastaLines(PackedSequence& sequence, std::string_view rest) {
+    while (!rest.empty()) {
+        const char* newline = static_cast<const char*>(std::memchr(rest.data(), '\n', rest.size()));
+        const size_t lineLength = newline ? newline - rest.data() : rest.size();
+        std::string_view line = rest.substr(0, lineLength);
+        rest.remove_prefix(newline ? lineLength + 1 : lineLength);
+
+        if (line.empty() || line[0] == '>')
+            continue;
+
+        // A line of nothing but spaces is kept as is
+        const size_t begin = std::find_if_not(line.begin(), line.end(), isTrimmed) - line.begin();
+        if (begin == line.size()) {
+            sequence.append(line);
+            continue;
+        }
+        const size_t end = line.size() - (std::find_if_not(line.rbegin(), line.rend(), isTrimmed) - line.rbegin());
+        sequence.append(line.substr(begin, end - begin));
+    }
+}
+
+} // namespace
+
+PackedSequence PackedSequence::loadFasta(const std::string& path) {
+    PackedSequence sequence;
+
+#ifndef EMSCRIPTEN
+    const MappedFile file(path);
+    sequence.m_words.reserve(file.contents().size() / basesPerWord + 1);
+    appendFastaLines(sequence, file.contents());
+#else
+    // Emscripten's mmap copies the whole file into the heap. Inputs are mounted from the browser's files, so they are
+    // read in chunks instead, and only the packed sequence is held in memory.
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        throw std::runtime_error("Cannot open file: " + path);
+
+    std::error_code ec;
+    const std::uintmax_t fileSize = std::filesystem::file_size(path, ec);
+    if (!ec)
+        sequence.m_words.reserve(fileSize / basesPerWord + 1);
+
+    constexpr size_t chunkSize = 1024 * 1024; // 1 MB
+    std::unique_ptr<char[]> chunk = std::make_unique<char[]>(chunkSize);
+    std::string pending; // complete lines, plus the start of a line that continues in the next chunk
+    while (const size_t numRead = std::fread(chunk.get(), 1, chunkSize, file)) {
+        pending.append(chunk.get(), numRead);
+        const size_t lastNewline = pending.rfind('\n');
+        if (lastNewline == std::string::npos)
+            continue;
+        appendFastaLines(sequence, std::string_view(pending).substr(0, lastNewline + 1));
+        pending.erase(0, lastNewline + 1);
+    }
+    std::fclose(file);
+    appendFastaLines(sequence, pending);
+#endif
+
+    sequence.m_words.shrink_to_fit();
+    sequence.m_exceptionRuns.shrink_to_fit();
+    sequence.m_lowercaseRuns.shrink_to_fit();
+    return sequence;
+}
+
+void PackedSequence::append(std::string_view bases) {
+    m_words.resize((m_size + bases.size() + basesPerWord - 1) / basesPerWord);
+
+    for (const char c : bases) {
+        uint8_t code = baseCodes[static_cast<uint8_t>(c)];
+        if (code == notACGT) {
+            if (!m_exceptionRuns.empty() && m_exceptionRuns.back().begin + m_exceptionRuns.back().length == m_size && m_exceptionRuns.back().base == c)
+                m_exceptionRuns.back().length++;
+            else
+                m_exceptionRuns.push_back({ m_size, 1, c });
+            code = 0;
+        } else if (c >= 'a') {
+            if (!m_lowercaseRuns.empty() && m_lowercaseRuns.back().begin + m_lowercaseRuns.back().length == m_size)
+                m_lowercaseRuns.back().length++;
+            else
+                m_lowercaseRuns.push_back({ m_size, 1 });
+        }
+
+        m_words[m_size / basesPerWord] |= uint64_t(code) << (2 * (m_size % basesPerWord));
+        m_size++;
+    }
+}
+
+void PackedSequence::extract(size_t pos, size_t len, std::string& out) const {
+    if (pos > m_size)
+        throw std::out_of_range("PackedSequence::extract: pos out of range");
+    len = std::min(len, m_size - pos);
+    const size_t end = pos + len;
+
+    out.resize(len);
+    for (size_t i = 0; i < len; i++) {
+        const size_t p = pos + i;
+        out[i] = codeBases[(m_words[p / basesPerWord] >> (2 * (p % basesPerWord))) & 3];
+    }
+
+    // Runs are sorted and do not overlap, so the first one that could overlap [pos, end) is the last one starting at
+    // or before pos
+    auto applyRuns = [&](const auto& runs, auto apply) {
+        auto it = std::upper_bound(runs.begin(), runs.end(), pos, [](size_t p, const auto& run) { return p < run.begin; });
+        if (it != runs.begin())
+            --it;
+        for (; it != runs.end() && it->begin < end; ++it) {
+            const size_t runBegin = std::max<size_t>(it->begin, pos);
+            const size_t runEnd = std::min<size_t>(it->begin + it->length, end);
+            for (size_t p = runBegin; p < runEnd; p++)
+                apply(out[p - pos], *it);
+        }
+    };
+
+    applyRuns(m_exceptionRuns, [](char& c, const ExceptionRun& run) { c = run.base; });
+    applyRuns(m_lowercaseRuns, [](char& c, const LowercaseRun&) { c = c - 'A' + 'a'; });
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// DNA sequence stored with 2 bits per base.
+//
+// Everything that is not one of A, C, G or T (N, IUPAC codes, ...) and lowercase (soft-masked) bases are kept as runs
+// on the side, so extract() returns exactly the characters that were appended.
+class PackedSequence {
+public:
+    // Loads all records of a FASTA file as one sequence, without headers and line breaks. Surrounding spaces and
+    // carriage returns of each line are removed.
+    static PackedSequence loadFasta(const std::string& path);
+
+    void append(std::string_view bases);
+
+    size_t size() const { return m_size; }
+
+    // Like std::string::substr, but into out
+    void extract(size_t pos, size_t len, std::string& out) const;
+
+private:
+    // Bases [begin, begin + length) are all `base`
+    struct ExceptionRun {
+        uint64_t begin;
+        uint64_t length;
+        char base;
+    };
+
+    // Bases [begin, begin + length) are lowercase
+    struct LowercaseRun {
+        uint64_t begin;
+        uint64_t length;
+    };
+
+private:
+    std::vector<uint64_t> m_words; // 32 bases per word, first base in the lowest bits
+    size_t m_size = 0;
+
+    std::vector<ExceptionRun> m_exceptionRuns; // sorted by begin
+    std::vector<LowercaseRun> m_lowercaseRuns; // sorted by begin
+};
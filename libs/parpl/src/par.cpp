@@ -1,8 +1,16 @@
 // A C++ program to replicate the functionality of par.pl
 
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <deque>
+#include <future>
 #include <iostream>
 #include <fstream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <vector>
@@ -10,19 +18,17 @@
 #include <unordered_set>
 #include <string>
 #include <filesystem>
-#include <regex>
+#include <thread>
 #include <cstdlib>
 #include <ctime>
 
 #include <bowtie.h>
+#include <trace.h>
 
-namespace fs = std::filesystem;
+#include "par.h"
+#include "thread_pool.h"
 
-enum class PrimerType {
-    inner,
-    outer,
-    loop,
-};
+namespace fs = std::filesystem;
 
 std::string toString(PrimerType t) {
     switch (t)
@@ -34,6 +40,33 @@ std::string toString(PrimerType t) {
     }
 }
 
+// Returns false if seq contains anything but A, C, G and T, in either case
+bool toUpperAcgt(std::string& seq) {
+    for (char& c : seq) {
+        switch (c) {
+            case 'A': case 'C': case 'G': case 'T': break;
+            case 'a': c = 'A'; break;
+            case 'c': c = 'C'; break;
+            case 'g': c = 'G'; break;
+            case 't': c = 'T'; break;
+            default: return false;
+        }
+    }
+    return true;
+}
+
+void reverseComplement(std::string_view seq, std::string& out) {
+    out.resize(seq.size());
+    for (size_t i = 0; i < seq.size(); i++) {
+        switch (seq[seq.size() - 1 - i]) {
+            case 'A': out[i] = 'T'; break;
+            case 'C': out[i] = 'G'; break;
+            case 'G': out[i] = 'C'; break;
+            default:  out[i] = 'A'; break;
+        }
+    }
+}
+
 struct Config {
     std::string prefix;
     std::string common_file;
@@ -46,6 +79,8 @@ struct Config {
     int threads = 1;
     bool left = false;
     bool loop = false;
+    bool single_pass = false;
+    std::string trace_file;
 };
 
 void printUsage() {
@@ -55,7 +90,8 @@ void printUsage() {
               << "  --common <genomes_list>\n"
               << "  [--specific <genomes_list>] [--left] [--loop]\n"
               << "  --bowtie <bowtie> --index <database>\n"
-              << "  [--mis_c <0-3>] [--mis_s <0-3>] [--threads <int>]\n";
+              << "  [--mis_c <0-3>] [--mis_s <0-3>] [--threads <int>] [--single_pass]\n"
+              << "  [--trace <trace_json>]\n";
     exit(EXIT_FAILURE);
 }
 
@@ -73,6 +109,8 @@ void parseArgs(int argc, const char* argv[], Config& cfg) {
         else if (arg == "--threads" && i + 1 < argc) cfg.threads = std::stoi(argv[++i]);
         else if (arg == "--left") cfg.left = true;
         else if (arg == "--loop") cfg.loop = true;
+        else if (arg == "--single_pass") cfg.single_pass = true;
+        else if (arg == "--trace" && i + 1 < argc) cfg.trace_file = argv[++i];
         else printUsage();
     }
 
@@ -100,110 +138,270 @@ std::string trim(const std::string& s) {
     return s.substr(begin, end - begin);
 }
 
-std::string readFastaSequence(const std::string& file_path) {
-    std::ifstream file(file_path);
-    if (!file.is_open())
-        throw std::runtime_error("Cannot open file: " + file_path);
-    std::string line, sequence;
-    while (std::getline(file, line)) {
-        if (line.empty() || line[0] == '>')
+struct StringHash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view s) const {
+        return std::hash<std::string_view>{}(s);
+    }
+};
+
+// Allows lookups by std::string_view without constructing a std::string
+using GenomeIdMap = std::unordered_map<std::string, unsigned, StringHash, std::equal_to<>>;
+
+// Assigns indices in order, skipping duplicates. uniqueNames receives the names by index.
+GenomeIdMap makeGenomeIdMap(const std::vector<std::string>& names, std::vector<std::string>& uniqueNames) {
+    GenomeIdMap result;
+    unsigned index = 0;
+    for (const std::string& name : names) {
+        if (result.count(name)) {
+            std::cerr << "Warning: Duplicate genome name: " << name << "\n";
             continue;
-        sequence += trim(line);
+        }
+        result[name] = index++;
+        uniqueNames.push_back(name);
     }
-    return sequence;
+    return result;
 }
 
-std::unordered_map<std::string, unsigned> loadGenomeIds(const std::string& file_path, std::vector<std::string>& names) {
-    std::unordered_map<std::string, unsigned> result;
+std::vector<std::string> readGenomeNames(const std::string& file_path) {
+    std::vector<std::string> names;
     std::ifstream file(file_path);
     if (!file.is_open()) throw std::runtime_error("Cannot open genome file: " + file_path);
     std::string line;
-    unsigned index = 0;
     while (std::getline(file, line)) {
         if (line[0] == '>') line = line.substr(1);
         std::string name = trim(line.substr(0, line.find(' ')));
         if (name.length() > 300)
             name = name.substr(0, 300);
-        if (result.count(name)) {
-            std::cerr << "Warning: Duplicate genome name: " << name << "\n";
+        names.push_back(std::move(name));
+    }
+    return names;
+}
+
+GenomeIdMap loadGenomeIds(const std::string& file_path, std::vector<std::string>& names) {
+    return makeGenomeIdMap(readGenomeNames(file_path), names);
+}
+
+std::vector<PrimerInfo> readPrimerCandidates(const std::string& path) {
+    std::vector<PrimerInfo> candidates;
+    std::ifstream infile(path);
+
+    std::string line;
+    while (std::getline(infile, line)) {
+        PrimerInfo info;
+        if (!parsePrimerRegionLine(line, info)) {
+            std::cerr << "Could not parse line `" << line << "`" << std::endl;
             continue;
         }
-        result[name] = index++;
-        names.push_back(name);
+        candidates.push_back(info);
     }
-    return result;
+
+    return candidates;
 }
 
-struct PrimerInfo {
-    int pos;
-    int len;
-    int plus;
-    int minus;
+// How the hits on a bowtie reference are classified
+enum class RefClass {
+    target,     // in the --common list
+    background, // in the --specific list
+    unknown,    // in neither, only written with --left
 };
 
-std::vector<std::string> split(const std::string& s, char delimiter) {
-    std::vector<std::string> tokens;
+// A bowtie reference, classified once when its first hit comes in
+struct RefGenome {
+    std::string name; // truncated like the genome lists
+    RefClass refClass;
+    unsigned genomeIndex; // into the --common or --specific list. With --left, assigned once all hits are in.
+};
 
-    size_t start = 0;
-    while (true) {
-        const size_t pos = s.find(delimiter, start);
-        const size_t n = pos != std::string::npos ? pos - start : std::string::npos;
-        tokens.push_back(s.substr(start, n));
-        if (pos == std::string::npos)
-            break;
-        start = pos + 1;
+constexpr unsigned unassignedGenomeIndex = std::numeric_limits<unsigned>::max();
+
+// Number of hits classified by one thread pool task
+constexpr size_t hitChunkSize = 64 * 1024;
+
+// A bowtie hit, copied out of the hit stream so it can be classified on another thread
+struct ChunkHit {
+    PrimerType primerType;
+    PrimerInfo info;
+    char strand;
+    unsigned refOffset;
+    RefGenome* genome;
+    unsigned mismatchBegin; // into HitChunk::mismatchPositions
+    unsigned numMismatches;
+};
+
+struct HitChunk {
+    std::vector<ChunkHit> hits;
+    std::vector<unsigned> mismatchPositions;
+};
+
+// A single region primer whose sequence is aligned as part of a bowtie read. Identical primers, and primers that are
+// reverse complements of each other, share one read.
+struct ReadMember {
+    PrimerType primerType;
+    PrimerInfo info;
+    bool reverseComplemented; // the read is the reverse complement of the primer
+};
+
+// Classification result of the hits of one primer type in a HitChunk, in the same order as the hits
+struct PrimerTypeOutput {
+    // parpl_main, lines of the output files
+    std::string common;
+    std::string specific;
+
+    // alignPrimerCandidates
+    std::vector<HitRecord> commonRecords;
+    std::vector<HitRecord> specificRecords;
+    std::vector<uint8_t> commonMismatches; // by commonRecords
+
+    // With --left, background genome ids are only handed out once all hits of the primer type are in. These are the
+    // offsets into `specific`, or the indices into `specificRecords`, at which they have to be inserted.
+    std::vector<std::pair<size_t, RefGenome*>> pendingBackgroundIds;
+};
+
+struct ChunkOutput {
+    std::array<PrimerTypeOutput, numPrimerTypes> byPrimerType;
+};
+
+// Alignment state of one of the comma-separated --index paths
+struct IndexShard {
+    std::deque<RefGenome> genomes; // by BowtieHit::refIndex, referenced by ChunkHit and ChunkOutput
+    std::vector<ChunkOutput> bufferedOutputs; // waiting for all previous shards to be written
+    bool done = false;
+    std::exception_ptr error;
+};
+
+template <typename T>
+void appendInt(std::string& s, T value) {
+    char buf[24];
+    const auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+    s.append(buf, end);
+}
+
+// Appends a hit table in the format of -common.txt and -specific.txt
+void appendHitTableText(std::string& out, std::span<const HitRecord> records) {
+    for (const HitRecord& record : records) {
+        appendInt(out, record.pos);
+        out += '\t';
+        appendInt(out, record.len);
+        out += '\t';
+        appendInt(out, record.genomeIndex);
+        out += '\t';
+        appendInt(out, record.refOffset);
+        out += '\t';
+        appendInt(out, record.plus);
+        out += '\t';
+        appendInt(out, record.minus);
+        out += '\n';
     }
-    return tokens;
 }
 
-int countMismatches(const std::string& mismatchField) {
-    return std::count(mismatchField.begin(), mismatchField.end(), ':');
+void writeHitTable(const std::string& path, std::span<const HitRecord> records) {
+    std::string text;
+    appendHitTableText(text, records);
+    std::ofstream out(path);
+    out.write(text.data(), text.size());
+}
+
+void writeCommonList(const std::string& path, const std::vector<std::string>& targetGenomeNames) {
+    std::ofstream commonListOut(path);
+    for (size_t i = 0; i < targetGenomeNames.size(); i++)
+        commonListOut << targetGenomeNames[i] + "\t" + std::to_string(i) + "\n";
 }
 
-std::vector<int> getMutationPositions(const std::string& field) {
-    std::vector<int> positions;
-    std::regex pattern(R"((\d+):)");
-    auto begin = std::sregex_iterator(field.begin(), field.end(), pattern);
-    auto end = std::sregex_iterator();
-    for (auto it = begin; it != end; ++it) {
-        positions.push_back(std::stoi((*it)[1]));
+void writeHitTables(const AlignResult& result, const std::string& dir, const std::string& prefix) {
+    for (const PrimerType primerType : result.primerTypes) {
+        const PrimerTypeHits& hits = result.byPrimerType[static_cast<size_t>(primerType)];
+        const std::string primerRegionsPath = dir + "/" + toString(primerType) + "/" + prefix;
+
+        if (result.targetGenomeNames) {
+            if (primerType == PrimerType::inner)
+                writeCommonList(primerRegionsPath + "-common_list.txt", *result.targetGenomeNames);
+            writeHitTable(primerRegionsPath + "-common.txt", hits.common);
+        }
+        if (result.hasSpecific)
+            writeHitTable(primerRegionsPath + "-specific.txt", hits.specific);
     }
-    return positions;
 }
 
 struct App {
 public:
+    // parpl_main
     void parseCliArgs(int argc, const char* argv[]);
     void readRefSequence();
     void loadTargetList();
     void loadBackgroundList();
-
+    void loadCandidates();
     void alignPrimers();
-    void alignPrimers(PrimerType primerType);
+    void run();
 
-private:
+    // alignPrimerCandidates
+    AlignResult alignCandidates(const PrimerCandidates& candidates, const AlignOptions& options);
 
-    void runBowtie(const std::string& indexPath, const std::string& inputFastaPath, const std::string& outputPath);
-    void processBowtieOutput(const std::string& bowtiePath);
+private:
+    void alignPrimers(std::span<const PrimerType> primerTypes);
+    void writeReads(std::span<const PrimerType> primerTypes, const std::string& fastaPath);
+    void openOutputs(PrimerType primerType);
+
+    void alignShard(size_t shardIndex, const std::string& inputFastaPath);
+    void runBowtie(size_t shardIndex, const std::string& inputFastaPath);
+    RefGenome classifyRef(std::string_view refName) const;
+    ChunkOutput classifyChunk(const HitChunk& chunk) const;
+    void emitChunkOutput(size_t shardIndex, ChunkOutput&& output);
+    void finishShard(size_t shardIndex);
+    void writeChunkOutput(ChunkOutput& output);
+    void writeSpecificOutput(size_t t, PrimerTypeOutput& primerTypeOutput);
+    void writeHeldSpecificOutputs(std::span<const PrimerType> primerTypes);
 
 private:
     Config m_cfg;
+    std::vector<PrimerType> m_primerTypes;
+    bool m_hasTargetList = false;
+    bool m_hasBackgroundList = false;
 
-    std::string m_refSequence;
+    PackedSequence m_loadedRefSequence; // parpl_main only
+    const PackedSequence* m_refSequence = &m_loadedRefSequence;
+    PrimerCandidates m_candidates;
     std::vector<std::string> m_bowtieIndexPaths;
+    std::vector<std::shared_ptr<const BowtieIndex>> m_bowtieIndexes; // by shard
     std::vector<std::string> m_targetGenomeNames;
-    std::unordered_map<std::string, unsigned> m_targetGenomeNameToIndex;
-    std::unordered_map<std::string, unsigned> m_backgroundGenomeNameToIndex;
+    GenomeIdMap m_targetGenomeNameToIndex;
+    GenomeIdMap m_backgroundGenomeNameToIndex;
+
+    // alignPrimerCandidates only. Receives the hit tables instead of the output files.
+    AlignResult* m_result = nullptr;
+
+    // Transient state while processing primer types, by PrimerType
+    std::array<std::unique_ptr<std::ofstream>, numPrimerTypes> m_commonOuts;
+    std::array<std::unique_ptr<std::ofstream>, numPrimerTypes> m_specialOuts;
+
+    // Transient state while aligning one set of primer types. Bowtie reads are named by their index, and read i stands
+    // for the primers m_readMembers[m_readMemberBegins[i]] up to m_readMembers[m_readMemberBegins[i + 1]].
+    std::vector<ReadMember> m_readMembers;
+    std::vector<unsigned> m_readMemberBegins;
 
-    // Transient state while processing one primer type
-    PrimerType m_primerType = {};
-    std::unique_ptr<std::ofstream> m_commonOut;
-    std::unique_ptr<std::ofstream> m_specialOut;
+    // Transient state while aligning against all indexes. Outputs are written in index order, so they are the same
+    // as if the indexes were aligned one after the other.
+    std::vector<IndexShard> m_shards;
+    size_t m_currentShard = 0; // the shard whose outputs are written right away
+    std::mutex m_outputMutex;
+
+    // With --left, the specific hits wait here until all of them are in, see writeHeldSpecificOutputs. By PrimerType.
+    std::array<std::vector<PrimerTypeOutput>, numPrimerTypes> m_heldSpecificOutputs;
+
+    // Declared last, so it is destroyed first and its tasks finish before the state they use goes away
+    std::unique_ptr<ThreadPool> m_threadPool;
 };
 
 void App::parseCliArgs(int argc, const char* argv[]) {
     parseArgs(argc, argv, m_cfg);
 
+    m_threadPool = std::make_unique<ThreadPool>(m_cfg.threads);
+
+    m_primerTypes = { PrimerType::inner, PrimerType::outer };
+    if (m_cfg.loop)
+        m_primerTypes.push_back(PrimerType::loop);
+
     std::stringstream ss(m_cfg.index);
     std::string token;
     while (std::getline(ss, token, ','))
@@ -211,185 +409,591 @@ void App::parseCliArgs(int argc, const char* argv[]) {
 }
 
 void App::readRefSequence() {
-    m_refSequence = readFastaSequence(m_cfg.ref_file);
+    m_loadedRefSequence = PackedSequence::loadFasta(m_cfg.ref_file);
 }
 
 void App::loadTargetList() {
-    m_targetGenomeNameToIndex = m_cfg.common_file.empty()
-        ? std::unordered_map<std::string, unsigned>()
-        : loadGenomeIds(m_cfg.common_file, m_targetGenomeNames);
+    m_hasTargetList = !m_cfg.common_file.empty();
+    m_targetGenomeNameToIndex = m_hasTargetList
+        ? loadGenomeIds(m_cfg.common_file, m_targetGenomeNames)
+        : GenomeIdMap();
 }
 
 void App::loadBackgroundList() {
+    m_hasBackgroundList = !m_cfg.special_file.empty();
     std::vector<std::string> special_names;
+    m_backgroundGenomeNameToIndex = m_hasBackgroundList
+        ? loadGenomeIds(m_cfg.special_file, special_names)
+        : GenomeIdMap();
+}
 
-    auto special_ids = m_cfg.special_file.empty()
-        ? std::unordered_map<std::string, unsigned>()
-        : loadGenomeIds(m_cfg.special_file, special_names);
+void App::loadCandidates() {
+    for (const PrimerType primerType : m_primerTypes) {
+        const std::string primerRegionsPath = m_cfg.dir + "/" + toString(primerType) + "/" + m_cfg.prefix;
+        m_candidates[static_cast<size_t>(primerType)] = readPrimerCandidates(primerRegionsPath);
+    }
 }
 
 void App::alignPrimers() {
-    alignPrimers(PrimerType::inner);
-    alignPrimers(PrimerType::outer);
-    if (m_cfg.loop)
-        alignPrimers(PrimerType::loop);
+    // Keep the indexes resident across all bowtie runs
+    for (const std::string& indexPath : m_bowtieIndexPaths)
+        m_bowtieIndexes.push_back(BowtieIndex::open(indexPath));
+
+    if (m_cfg.single_pass) {
+        // One bowtie run per index for all primer types
+        alignPrimers(m_primerTypes);
+    } else {
+        for (const PrimerType primerType : m_primerTypes)
+            alignPrimers({ &primerType, 1 });
+    }
 }
 
-void App::alignPrimers(PrimerType primerType) {
-    m_primerType = primerType;
+void App::run() {
+    setTracingEnabled(!m_cfg.trace_file.empty());
 
-    const std::string primerRegionsPath = m_cfg.dir + "/" + toString(m_primerType) + "/" + m_cfg.prefix;
-    const std::string fastaPath = primerRegionsPath + ".fa";
-
-    // Create input FASTA file
     {
-        std::ifstream infile(primerRegionsPath);
-        std::ofstream outfile(fastaPath);
-
-        std::string line;
-        while (std::getline(infile, line)) {
-            std::smatch match;
-            if (!std::regex_search(line, match, std::regex(R"(pos:(\d+)\tlength:(\d+)\t\+:(\d)\t-:(\d))"))) {
-                std::cerr << "Could not parse line `" << line << "`" << std::endl;
-                continue;
+        TraceScope trace("parpl");
+        readRefSequence();
+        loadTargetList();
+        loadBackgroundList();
+        loadCandidates();
+        alignPrimers();
+    }
+
+    if (!m_cfg.trace_file.empty())
+        writeTrace(m_cfg.trace_file);
+}
+
+AlignResult App::alignCandidates(const PrimerCandidates& candidates, const AlignOptions& options) {
+    m_cfg.dir = options.tempDir;
+    m_cfg.prefix = "parpl";
+    m_cfg.mis_c = options.mis_c;
+    m_cfg.mis_s = options.mis_s;
+    m_cfg.threads = options.threads;
+    m_cfg.left = options.left;
+    m_cfg.single_pass = options.single_pass;
+    m_primerTypes = options.primerTypes;
+
+    m_threadPool = std::make_unique<ThreadPool>(m_cfg.threads);
+    m_refSequence = options.refSequence;
+    m_candidates = candidates;
+    m_bowtieIndexes = options.indexes;
+    m_bowtieIndexPaths.clear();
+    for (const std::shared_ptr<const BowtieIndex>& index : m_bowtieIndexes)
+        m_bowtieIndexPaths.push_back(index->getPath());
+
+    m_hasTargetList = options.targetGenomeNames.has_value();
+    if (m_hasTargetList)
+        m_targetGenomeNameToIndex = makeGenomeIdMap(*options.targetGenomeNames, m_targetGenomeNames);
+
+    m_hasBackgroundList = options.backgroundGenomeNames.has_value();
+    if (m_hasBackgroundList) {
+        std::vector<std::string> backgroundGenomeNames;
+        m_backgroundGenomeNameToIndex = makeGenomeIdMap(*options.backgroundGenomeNames, backgroundGenomeNames);
+    }
+
+    AlignResult result;
+    result.primerTypes = m_primerTypes;
+    if (m_hasTargetList)
+        result.targetGenomeNames = m_targetGenomeNames;
+    result.hasSpecific = m_hasBackgroundList || m_cfg.left;
+
+    m_result = &result;
+    if (m_cfg.single_pass) {
+        alignPrimers(m_primerTypes);
+    } else {
+        for (const PrimerType primerType : m_primerTypes)
+            alignPrimers({ &primerType, 1 });
+    }
+    m_result = nullptr;
+
+    return result;
+}
+
+AlignResult filterTargetHits(const AlignResult& result, int mis_c) {
+    if (mis_c < 0 || mis_c > 3)
+        throw std::invalid_argument("Invalid mismatch parameter: mis_c " + std::to_string(mis_c));
+
+    AlignResult filtered;
+    filtered.primerTypes = result.primerTypes;
+    filtered.targetGenomeNames = result.targetGenomeNames;
+    filtered.hasSpecific = result.hasSpecific;
+
+    for (size_t t = 0; t < numPrimerTypes; t++) {
+        const PrimerTypeHits& hits = result.byPrimerType[t];
+        PrimerTypeHits& filteredHits = filtered.byPrimerType[t];
+        for (size_t i = 0; i < hits.common.size(); i++) {
+            if (hits.commonMismatches[i] <= mis_c) {
+                filteredHits.common.push_back(hits.common[i]);
+                filteredHits.commonMismatches.push_back(hits.commonMismatches[i]);
+            }
+        }
+        filteredHits.specific = hits.specific;
+    }
+
+    return filtered;
+}
+
+void App::writeReads(std::span<const PrimerType> primerTypes, const std::string& fastaPath) {
+    // Repeats in the reference and overlapping candidates of different primer types yield the same sequence many
+    // times, so every sequence is aligned once. Sequences of only A, C, G and T are also merged with their reverse
+    // complement. Others are kept as they are, since bowtie treats N and IUPAC codes as mismatches on both strands.
+    std::unordered_map<std::string, unsigned> readIndices;
+    std::vector<std::string_view> reads; // keys of readIndices, by read index
+    std::vector<std::pair<unsigned, ReadMember>> members; // by read index
+
+    std::string primerSeq;
+    std::string reverseComplementSeq;
+    for (const PrimerType primerType : primerTypes) {
+        for (const PrimerInfo& info : m_candidates[static_cast<size_t>(primerType)]) {
+            m_refSequence->extract(info.pos, info.len, primerSeq);
+
+            bool reverseComplemented = false;
+            if (toUpperAcgt(primerSeq)) {
+                reverseComplement(primerSeq, reverseComplementSeq);
+                if (reverseComplementSeq < primerSeq) {
+                    primerSeq.swap(reverseComplementSeq);
+                    reverseComplemented = true;
+                }
             }
 
-            int pos = std::stoi(match[1]);
-            int len = std::stoi(match[2]);
-            std::string name = match[1].str() + "-" + match[2].str() + "-" + match[3].str() + "-" + match[4].str();
-            std::string primer_seq = m_refSequence.substr(pos, len);
-            outfile << ">" << name << "\n" << primer_seq << "\n";
+            const auto [it, inserted] = readIndices.try_emplace(primerSeq, static_cast<unsigned>(reads.size()));
+            if (inserted)
+                reads.push_back(it->first);
+            members.push_back({ it->second, { primerType, info, reverseComplemented } });
         }
     }
 
-    // Open output files
-    if (!m_cfg.common_file.empty())
+    // Group the members by read
+    m_readMemberBegins.assign(reads.size() + 1, 0);
+    for (const auto& [readIndex, member] : members)
+        m_readMemberBegins[readIndex + 1]++;
+    for (size_t i = 0; i < reads.size(); i++)
+        m_readMemberBegins[i + 1] += m_readMemberBegins[i];
+
+    m_readMembers.resize(members.size());
+    std::vector<unsigned> next(m_readMemberBegins.begin(), m_readMemberBegins.end() - 1);
+    for (const auto& [readIndex, member] : members)
+        m_readMembers[next[readIndex]++] = member;
+
+    std::ofstream outfile(fastaPath);
+    if (!outfile)
+        throw std::runtime_error("Cannot open file: " + fastaPath);
+
+    for (size_t i = 0; i < reads.size(); i++)
+        outfile << '>' << i << '\n' << reads[i] << '\n';
+}
+
+void App::openOutputs(PrimerType primerType) {
+    const size_t t = static_cast<size_t>(primerType);
+    const std::string primerRegionsPath = m_cfg.dir + "/" + toString(primerType) + "/" + m_cfg.prefix;
+
+    if (m_hasTargetList)
     {
-        if (m_primerType == PrimerType::inner)
-        {
-            // Create common_list.txt
-            std::ofstream commonListOut(primerRegionsPath + "-common_list.txt");
-            for (size_t i = 0; i < m_targetGenomeNames.size(); i++)
-                commonListOut << m_targetGenomeNames[i] + "\t" + std::to_string(i) + "\n";
-        }
+        if (primerType == PrimerType::inner)
+            writeCommonList(primerRegionsPath + "-common_list.txt", m_targetGenomeNames);
 
-        m_commonOut = std::make_unique<std::ofstream>(primerRegionsPath + "-common.txt");
+        m_commonOuts[t] = std::make_unique<std::ofstream>(primerRegionsPath + "-common.txt");
     }
-    if ((!m_cfg.special_file.empty() || m_cfg.left))
+    if (m_hasBackgroundList || m_cfg.left)
     {
-        m_specialOut = std::make_unique<std::ofstream>(primerRegionsPath + "-specific.txt");
+        m_specialOuts[t] = std::make_unique<std::ofstream>(primerRegionsPath + "-specific.txt");
+    }
+}
+
+void App::alignPrimers(std::span<const PrimerType> primerTypes) {
+    // With alignPrimerCandidates, the alignments run one after the other, so they can share one file
+    const std::string fastaPath = primerTypes.size() == 1 && !m_result
+        ? m_cfg.dir + "/" + toString(primerTypes[0]) + "/" + m_cfg.prefix + ".fa"
+        : m_cfg.dir + "/" + m_cfg.prefix + ".fa";
+
+    std::string traceName = "align";
+    for (const PrimerType primerType : primerTypes)
+        traceName += " " + toString(primerType);
+    TraceScope trace(traceName);
+
+    writeReads(primerTypes, fastaPath);
+
+    if (!m_result) {
+        for (const PrimerType primerType : primerTypes)
+            openOutputs(primerType);
     }
 
-    for (const std::string& indexPath: m_bowtieIndexPaths)
+    // Align against all indexes at once
+    m_shards = std::vector<IndexShard>(m_bowtieIndexPaths.size());
+    m_currentShard = 0;
     {
-        const std::string bowtieOutputPath = primerRegionsPath + "_" + toString(m_primerType) + ".bowtie";
-        runBowtie(indexPath, fastaPath, bowtieOutputPath);
-        processBowtieOutput(bowtieOutputPath);
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < m_shards.size(); i++)
+            threads.emplace_back([this, i, &fastaPath] { alignShard(i, fastaPath); });
+        alignShard(0, fastaPath);
+        for (std::thread& thread : threads)
+            thread.join();
     }
+    for (const IndexShard& shard : m_shards) {
+        if (shard.error) {
+            for (std::vector<PrimerTypeOutput>& outputs : m_heldSpecificOutputs)
+                outputs.clear();
+            std::rethrow_exception(shard.error);
+        }
+    }
+    writeHeldSpecificOutputs(primerTypes);
+    m_shards.clear();
 
     std::remove(fastaPath.c_str());
-    m_commonOut.reset();
-    m_specialOut.reset();
+    for (size_t t = 0; t < numPrimerTypes; t++) {
+        m_commonOuts[t].reset();
+        m_specialOuts[t].reset();
+    }
 }
 
-void App::runBowtie(const std::string& indexPath, const std::string& inputFastaPath, const std::string& outputPath) {
+void App::alignShard(size_t shardIndex, const std::string& inputFastaPath) {
+    try {
+        runBowtie(shardIndex, inputFastaPath);
+    } catch (...) {
+        m_shards[shardIndex].error = std::current_exception();
+    }
+    finishShard(shardIndex);
+}
+
+void App::runBowtie(size_t shardIndex, const std::string& inputFastaPath) {
+    const BowtieIndex& index = *m_bowtieIndexes[shardIndex];
+    TraceScope trace("bowtie " + index.getPath());
+
+#ifndef EMSCRIPTEN
+    // All indexes are aligned at the same time, so they share the threads
+    const int numThreads = std::max<int>(1, m_cfg.threads / m_bowtieIndexPaths.size());
+#else
+    // bowtie runs in this process and keeps its options in globals, so the indexes take turns, each with all threads
+    const int numThreads = std::max<int>(1, m_cfg.threads);
+#endif
+
     const std::string v = std::to_string(m_cfg.mis_s);
-    const std::string p = std::to_string(m_cfg.threads);
+    const std::string p = std::to_string(numThreads);
     std::vector<const char*> bowtieArgs {
         "bowtie", // executable name
         "-f",
         "--suppress", "5,6,7",
         "-v", v.c_str(),
         "-p", p.c_str(),
-        "-a", indexPath.c_str(),
-        inputFastaPath.c_str(),
-        outputPath.c_str(),
+        "-a",
+    };
+
+    // Hits are classified in chunks on the thread pool. Results are written in chunk order, so the output is the same
+    // as if all hits were classified one after the other.
+    std::deque<std::future<ChunkOutput>> pendingOutputs;
+    const size_t maxNumPendingOutputs = 2 * m_threadPool->size();
+
+    // The chunks still being classified point into genomes, so they have to finish before the shard can be torn down,
+    // also when bowtie or the output fails
+    struct PendingOutputsGuard {
+        std::deque<std::future<ChunkOutput>>& outputs;
+
+        ~PendingOutputsGuard() {
+            for (std::future<ChunkOutput>& output : outputs) {
+                if (output.valid())
+                    output.wait();
+            }
+        }
+    } pendingOutputsGuard { pendingOutputs };
+
+    // Classify every reference of the index once, so hits only look theirs up by index
+    std::deque<RefGenome>& genomes = m_shards[shardIndex].genomes;
+    for (const std::string& refName : index.getRefNames())
+        genomes.push_back(classifyRef(refName));
+
+    HitChunk chunk;
+
+    auto submitChunk = [&] {
+        pendingOutputs.push_back(m_threadPool->submit([this, chunk = std::move(chunk)] { return classifyChunk(chunk); }));
+        chunk = {};
+
+        while (pendingOutputs.size() > maxNumPendingOutputs) {
+            emitChunkOutput(shardIndex, pendingOutputs.front().get());
+            pendingOutputs.pop_front();
+        }
     };
 
-    bowtie(bowtieArgs.size(), bowtieArgs.data());
+    const int exitCode = index.align(bowtieArgs.size(), bowtieArgs.data(), inputFastaPath, [&](const BowtieHit& hit) {
+        // Without the index's reference names, references are classified when they are first hit
+        if (hit.refIndex == genomes.size())
+            genomes.push_back(classifyRef(hit.refName));
+        if (hit.refIndex >= genomes.size())
+            return;
+        RefGenome& genome = genomes[hit.refIndex];
+
+        // Reads are named by their index, see writeReads
+        unsigned readIndex = 0;
+        const char* nameEnd = hit.readName.data() + hit.readName.size();
+        const auto [nameParsedEnd, ec] = std::from_chars(hit.readName.data(), nameEnd, readIndex);
+        if (hit.readName.empty() || ec != std::errc() || nameParsedEnd != nameEnd)
+            return;
+        if (static_cast<size_t>(readIndex) + 1 >= m_readMemberBegins.size())
+            return;
+
+        // Hand the hit to every primer of the read. For a primer that is the reverse complement of the read, the
+        // alignment is on the other strand, at the same offset, and its mismatches count from the other end.
+        for (unsigned m = m_readMemberBegins[readIndex]; m < m_readMemberBegins[readIndex + 1]; m++) {
+            const ReadMember& member = m_readMembers[m];
+
+            ChunkHit& chunkHit = chunk.hits.emplace_back();
+            chunkHit.primerType = member.primerType;
+            chunkHit.info = member.info;
+            chunkHit.strand = member.reverseComplemented ? (hit.strand == '+' ? '-' : '+') : hit.strand;
+            chunkHit.refOffset = hit.refOffset;
+            chunkHit.genome = &genome;
+            chunkHit.mismatchBegin = chunk.mismatchPositions.size();
+            chunkHit.numMismatches = hit.mismatchPositions.size();
+            for (const unsigned pos : hit.mismatchPositions)
+                chunk.mismatchPositions.push_back(member.reverseComplemented ? member.info.len - 1 - pos : pos);
+
+            if (chunk.hits.size() == hitChunkSize)
+                submitChunk();
+        }
+    });
+
+    if (exitCode != 0)
+        throw std::runtime_error("bowtie failed with exit code " + std::to_string(exitCode) + " on index " + index.getPath());
+
+    if (!chunk.hits.empty())
+        submitChunk();
+
+    for (std::future<ChunkOutput>& output : pendingOutputs)
+        emitChunkOutput(shardIndex, output.get());
 }
 
-void App::processBowtieOutput(const std::string& bowtiePath) {
-    std::ifstream file(bowtiePath);
-    if (!file) throw std::runtime_error("Unable to open Bowtie output file: " + bowtiePath);
-    std::string line;
-    while (std::getline(file, line)) {
-        auto fields = split(line, '\t');
-        if (fields.size() < 5) continue;
+RefGenome App::classifyRef(std::string_view refName) const {
+    RefGenome genome { std::string(refName.substr(0, 300)), RefClass::unknown, unassignedGenomeIndex };
 
-        std::string primerName = fields[0];
-        std::string strand = fields[1];
-        std::string genomeId = fields[2].substr(0, std::min(300UL, fields[2].size()));
-        std::string sequenceRead = fields[3];
-        std::string mismatchField = fields[4];
+    if (m_hasTargetList) {
+        if (const auto it = m_targetGenomeNameToIndex.find(genome.name); it != m_targetGenomeNameToIndex.end()) {
+            genome.refClass = RefClass::target;
+            genome.genomeIndex = it->second;
+            return genome;
+        }
+    }
 
-        int mismatches = countMismatches(mismatchField);
+    if (m_hasBackgroundList) {
+        if (const auto it = m_backgroundGenomeNameToIndex.find(genome.name); it != m_backgroundGenomeNameToIndex.end()) {
+            genome.refClass = RefClass::background;
+            genome.genomeIndex = it->second;
+        }
+    }
+
+    return genome;
+}
+
+ChunkOutput App::classifyChunk(const HitChunk& chunk) const {
+    ChunkOutput output;
 
-        int pos, len, plus, minus;
-        if (sscanf(primerName.c_str(), "%d-%d-%d-%d", &pos, &len, &plus, &minus) != 4) continue;
+    for (const ChunkHit& hit : chunk.hits) {
+        const auto [pos, len, plus, minus] = hit.info;
+        const PrimerType primerType = hit.primerType;
+        PrimerTypeOutput& primerTypeOutput = output.byPrimerType[static_cast<size_t>(primerType)];
+        RefGenome& genome = *hit.genome;
+        const int mismatches = hit.numMismatches;
 
         bool begin = false, stop = false;
-        auto mutationPositions = getMutationPositions(mismatchField);
-        for (int mut : mutationPositions) {
+        for (unsigned i = 0; i < hit.numMismatches; i++) {
+            const int mut = chunk.mismatchPositions[hit.mismatchBegin + i];
             if (mut < 5) begin = true;
             if (mut >= len - 5) stop = true;
         }
 
         int strandMatchPlus = 0, strandMatchMinus = 0;
 
-        if (m_primerType == PrimerType::inner) {
-            if (plus && !begin) (strand == "+" ? strandMatchPlus : strandMatchMinus) = 1;
-            if (minus && !stop)  (strand == "+" ? strandMatchMinus : strandMatchPlus) = 1;
+        if (primerType == PrimerType::inner) {
+            if (plus && !begin) (hit.strand == '+' ? strandMatchPlus : strandMatchMinus) = 1;
+            if (minus && !stop)  (hit.strand == '+' ? strandMatchMinus : strandMatchPlus) = 1;
         } else {
-            if (plus && !stop)   (strand == "+" ? strandMatchPlus : strandMatchMinus) = 1;
-            if (minus && !begin) (strand == "+" ? strandMatchMinus : strandMatchPlus) = 1;
+            if (plus && !stop)   (hit.strand == '+' ? strandMatchPlus : strandMatchMinus) = 1;
+            if (minus && !begin) (hit.strand == '+' ? strandMatchMinus : strandMatchPlus) = 1;
         }
 
         if (strandMatchPlus + strandMatchMinus == 0) continue;
 
-        const bool hasTargetList = !m_cfg.common_file.empty();
-        if (hasTargetList && m_targetGenomeNameToIndex.count(genomeId)) {
-            if (mismatches <= m_cfg.mis_c) {
-                *m_commonOut << pos << '\t' << len << '\t' << m_targetGenomeNameToIndex.at(genomeId) << '\t' << sequenceRead
-                        << '\t' << strandMatchPlus << '\t' << strandMatchMinus << '\n';
-
+        // Appends `pos len genomeIndex offset plus minus`. Without a genome index, the caller inserts it later.
+        auto appendLine = [&](bool specific, const unsigned* genomeIndex) {
+            if (m_result) {
+                std::vector<HitRecord>& records = specific ? primerTypeOutput.specificRecords : primerTypeOutput.commonRecords;
+                if (!specific)
+                    primerTypeOutput.commonMismatches.push_back(static_cast<uint8_t>(mismatches));
+                if (!genomeIndex)
+                    primerTypeOutput.pendingBackgroundIds.emplace_back(records.size(), &genome);
+                records.push_back({
+                    .pos = static_cast<uint32_t>(pos),
+                    .genomeIndex = genomeIndex ? *genomeIndex : 0,
+                    .refOffset = hit.refOffset,
+                    .len = static_cast<uint16_t>(len),
+                    .plus = static_cast<uint8_t>(strandMatchPlus),
+                    .minus = static_cast<uint8_t>(strandMatchMinus),
+                });
+                return;
             }
+
+            std::string& out = specific ? primerTypeOutput.specific : primerTypeOutput.common;
+            appendInt(out, pos);
+            out += '\t';
+            appendInt(out, len);
+            out += '\t';
+            if (genomeIndex)
+                appendInt(out, *genomeIndex);
+            else
+                primerTypeOutput.pendingBackgroundIds.emplace_back(out.size(), &genome);
+            out += '\t';
+            appendInt(out, hit.refOffset);
+            out += '\t';
+            appendInt(out, strandMatchPlus);
+            out += '\t';
+            appendInt(out, strandMatchMinus);
+            out += '\n';
+        };
+
+        if (genome.refClass == RefClass::target) {
+            if (mismatches <= m_cfg.mis_c)
+                appendLine(false, &genome.genomeIndex);
             continue;
         }
 
-        if (m_primerType == PrimerType::loop)
+        if (primerType == PrimerType::loop)
             continue;
 
-        const bool hasExplicitBackgroundList = !m_cfg.special_file.empty();
-        if (hasExplicitBackgroundList) {
-            if (m_backgroundGenomeNameToIndex.count(genomeId)) {
-                *m_specialOut << pos << '\t' << len << '\t' << m_backgroundGenomeNameToIndex.at(genomeId) << '\t' << sequenceRead
-                        << '\t' << strandMatchPlus << '\t' << strandMatchMinus << '\n';
-            }
-            continue;
+        if (genome.refClass == RefClass::background)
+            appendLine(true, &genome.genomeIndex);
+        else if (!m_hasBackgroundList && m_cfg.left)
+            appendLine(true, nullptr);
+    }
+
+    return output;
+}
+
+void App::emitChunkOutput(size_t shardIndex, ChunkOutput&& output) {
+    std::lock_guard lock(m_outputMutex);
+
+    if (shardIndex == m_currentShard)
+        writeChunkOutput(output);
+    else
+        m_shards[shardIndex].bufferedOutputs.push_back(std::move(output));
+}
+
+void App::finishShard(size_t shardIndex) {
+    std::lock_guard lock(m_outputMutex);
+
+    m_shards[shardIndex].done = true;
+
+    // Catch up on the outputs of the following shards
+    while (m_currentShard < m_shards.size() && m_shards[m_currentShard].done) {
+        m_currentShard++;
+        if (m_currentShard == m_shards.size())
+            break;
+
+        std::vector<ChunkOutput>& bufferedOutputs = m_shards[m_currentShard].bufferedOutputs;
+        for (ChunkOutput& output : bufferedOutputs)
+            writeChunkOutput(output);
+        bufferedOutputs = {};
+    }
+}
+
+void App::writeChunkOutput(ChunkOutput& output) {
+    for (size_t t = 0; t < numPrimerTypes; t++) {
+        PrimerTypeOutput& primerTypeOutput = output.byPrimerType[t];
+
+        if (m_result) {
+            PrimerTypeHits& hits = m_result->byPrimerType[t];
+            hits.common.insert(hits.common.end(), primerTypeOutput.commonRecords.begin(), primerTypeOutput.commonRecords.end());
+            hits.commonMismatches.insert(hits.commonMismatches.end(), primerTypeOutput.commonMismatches.begin(), primerTypeOutput.commonMismatches.end());
+            primerTypeOutput.commonRecords = {};
+            primerTypeOutput.commonMismatches = {};
+        } else {
+            if (!primerTypeOutput.common.empty())
+                m_commonOuts[t]->write(primerTypeOutput.common.data(), primerTypeOutput.common.size());
+            primerTypeOutput.common = {};
         }
 
-        if (m_cfg.left) {
-            if (m_backgroundGenomeNameToIndex.count(genomeId)) {
-                *m_specialOut << pos << '\t' << len << '\t' << m_backgroundGenomeNameToIndex.at(genomeId) << '\t' << sequenceRead
-                        << '\t' << strandMatchPlus << '\t' << strandMatchMinus << '\n';
+        if (primerTypeOutput.pendingBackgroundIds.empty())
+            writeSpecificOutput(t, primerTypeOutput);
+        else
+            m_heldSpecificOutputs[t].push_back(std::move(primerTypeOutput));
+    }
+}
+
+void App::writeHeldSpecificOutputs(std::span<const PrimerType> primerTypes) {
+    for (const PrimerType primerType : primerTypes) {
+        const size_t t = static_cast<size_t>(primerType);
+
+        // Hand out ids to the new background genomes of this primer type by name, so they depend neither on the
+        // order of the hits nor on whether the primer types were aligned together
+        std::unordered_set<RefGenome*> newGenomes;
+        for (const PrimerTypeOutput& output : m_heldSpecificOutputs[t]) {
+            for (const auto& [index, genome] : output.pendingBackgroundIds) {
+                if (genome->genomeIndex == unassignedGenomeIndex)
+                    newGenomes.insert(genome);
             }
-            else {
-                const size_t backgroundGenomeIndex = m_backgroundGenomeNameToIndex.size();
-                m_backgroundGenomeNameToIndex[genomeId] = backgroundGenomeIndex;
-                *m_specialOut << pos << '\t' << len << '\t' << backgroundGenomeIndex << '\t' << sequenceRead
-                        << '\t' << strandMatchPlus << '\t' << strandMatchMinus << '\n';
+        }
+        std::vector<RefGenome*> sortedGenomes(newGenomes.begin(), newGenomes.end());
+        std::sort(sortedGenomes.begin(), sortedGenomes.end(), [](const RefGenome* a, const RefGenome* b) { return a->name < b->name; });
+
+        // Different shards can have the same genome, so the ids are shared by name
+        for (RefGenome* genome : sortedGenomes) {
+            auto it = m_backgroundGenomeNameToIndex.find(genome->name);
+            if (it == m_backgroundGenomeNameToIndex.end()) {
+                const unsigned backgroundGenomeIndex = m_backgroundGenomeNameToIndex.size();
+                it = m_backgroundGenomeNameToIndex.emplace(genome->name, backgroundGenomeIndex).first;
             }
+            genome->genomeIndex = it->second;
         }
+
+        for (PrimerTypeOutput& output : m_heldSpecificOutputs[t])
+            writeSpecificOutput(t, output);
+        m_heldSpecificOutputs[t].clear();
+    }
+}
+
+void App::writeSpecificOutput(size_t t, PrimerTypeOutput& primerTypeOutput) {
+    if (m_result) {
+        for (const auto& [index, genome] : primerTypeOutput.pendingBackgroundIds)
+            primerTypeOutput.specificRecords[index].genomeIndex = genome->genomeIndex;
+
+        PrimerTypeHits& hits = m_result->byPrimerType[t];
+        hits.specific.insert(hits.specific.end(), primerTypeOutput.specificRecords.begin(), primerTypeOutput.specificRecords.end());
+        return;
+    }
+
+    if (primerTypeOutput.specific.empty())
+        return;
+
+    std::ofstream& specialOut = *m_specialOuts[t];
+    size_t written = 0;
+    for (const auto& [offset, genome] : primerTypeOutput.pendingBackgroundIds) {
+        specialOut.write(primerTypeOutput.specific.data() + written, offset - written);
+        specialOut << genome->genomeIndex;
+        written = offset;
     }
+    specialOut.write(primerTypeOutput.specific.data() + written, primerTypeOutput.specific.size() - written);
 }
 
 int parpl_main(int argc, const char* argv[]) {
     App app;
     app.parseCliArgs(argc, argv);
-    app.readRefSequence();
-    app.loadTargetList();
-    app.loadBackgroundList();
-    app.alignPrimers();
+    app.run();
     return 0;
 }
+
+// The checks parseArgs does for parpl_main
+static void validateMismatches(int mis_c, int mis_s) {
+    if (mis_c < 0 || mis_c > 3 || mis_s < 0 || mis_s > 3 || mis_c > mis_s)
+        throw std::invalid_argument("Invalid mismatch parameters: mis_c " + std::to_string(mis_c) + ", mis_s " + std::to_string(mis_s));
+}
+
+AlignResult alignPrimerCandidates(const PrimerCandidates& candidates, const AlignOptions& options) {
+    if (!options.refSequence)
+        throw std::invalid_argument("AlignOptions::refSequence is not set");
+    if (options.indexes.empty() || std::find(options.indexes.begin(), options.indexes.end(), nullptr) != options.indexes.end())
+        throw std::invalid_argument("AlignOptions::indexes is empty or contains null");
+    validateMismatches(options.mis_c, options.mis_s);
+    if (options.threads < 1)
+        throw std::invalid_argument("Invalid number of threads: " + std::to_string(options.threads));
+
+    App app;
+    return app.alignCandidates(candidates, options);
+}
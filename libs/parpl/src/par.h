@@ -1,3 +1,87 @@
 #pragma once
 
-int parpl_main(int argc, const char* argv[]);
\ No newline at end of file
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "packed_sequence.h"
+#include "parse.h"
+
+class BowtieIndex;
+
+enum class PrimerType {
+    inner,
+    outer,
+    loop,
+};
+
+constexpr size_t numPrimerTypes = 3;
+
+std::string toString(PrimerType t);
+
+// Single region primers as generated by GLAPD's Single stage, by PrimerType
+using PrimerCandidates = std::array<std::vector<PrimerInfo>, numPrimerTypes>;
+
+// Reads a single region primer file, e.g. /tmp/Inner/NAME. Lines that cannot be parsed are skipped.
+std::vector<PrimerInfo> readPrimerCandidates(const std::string& path);
+
+// Reads a genome list like --common and --specific, e.g. `>name description` per line
+std::vector<std::string> readGenomeNames(const std::string& path);
+
+// The options of parpl_main, with the inputs already loaded
+struct AlignOptions {
+    const PackedSequence* refSequence = nullptr;
+    std::vector<std::shared_ptr<const BowtieIndex>> indexes;
+    std::vector<PrimerType> primerTypes = { PrimerType::inner, PrimerType::outer }; // --loop adds PrimerType::loop
+
+    std::optional<std::vector<std::string>> targetGenomeNames;     // --common
+    std::optional<std::vector<std::string>> backgroundGenomeNames; // --specific
+    bool left = false;
+
+    int mis_c = 0;
+    int mis_s = 2;
+    int threads = 1;
+    bool single_pass = false;
+
+    std::string tempDir; // for the bowtie input FASTA
+};
+
+// One line of -common.txt or -specific.txt
+struct HitRecord {
+    uint32_t pos;
+    uint32_t genomeIndex;
+    uint32_t refOffset;
+    uint16_t len;
+    uint8_t plus;
+    uint8_t minus;
+};
+
+// The hit tables of one primer type, as they would be written to -common.txt and -specific.txt
+struct PrimerTypeHits {
+    std::vector<HitRecord> common;
+    std::vector<HitRecord> specific;
+    std::vector<uint8_t> commonMismatches; // by hit in common
+};
+
+struct AlignResult {
+    std::vector<PrimerType> primerTypes;
+    std::optional<std::vector<std::string>> targetGenomeNames; // without duplicates, indexed by HitRecord::genomeIndex
+    bool hasSpecific = false;
+    std::array<PrimerTypeHits, numPrimerTypes> byPrimerType;
+};
+
+// Aligns the single region primers and classifies the hits like parpl_main, but returns the hit tables instead of
+// writing them. Only the bowtie input goes through a file.
+AlignResult alignPrimerCandidates(const PrimerCandidates& candidates, const AlignOptions& options);
+
+// Returns the hits as if aligned with AlignOptions::mis_c = mis_c. Hits in target genomes are dropped, not moved to
+// the specific ones, so a result aligned with a larger mis_c can be narrowed down without aligning again.
+AlignResult filterTargetHits(const AlignResult& result, int mis_c);
+
+// Writes the files parpl_main writes, e.g. <dir>/Inner/<prefix>-common.txt. The directories have to exist.
+void writeHitTables(const AlignResult& result, const std::string& dir, const std::string& prefix);
+
+int parpl_main(int argc, const char* argv[]);
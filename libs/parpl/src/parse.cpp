@@ -0,0 +1,48 @@
+#include "parse.h"
+
+#include <charconv>
+
+namespace {
+
+bool consume(std::string_view& s, std::string_view prefix) {
+    if (!s.starts_with(prefix))
+        return false;
+    s.remove_prefix(prefix.size());
+    return true;
+}
+
+// Consumes one or more decimal digits, like `\d+`
+bool consumeInt(std::string_view& s, int& value) {
+    if (s.empty() || s[0] < '0' || s[0] > '9')
+        return false;
+    const auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    if (ec != std::errc())
+        return false;
+    s.remove_prefix(ptr - s.data());
+    return true;
+}
+
+// Consumes exactly one decimal digit, like `\d`
+bool consumeDigit(std::string_view& s, int& value) {
+    if (s.empty() || s[0] < '0' || s[0] > '9')
+        return false;
+    value = s[0] - '0';
+    s.remove_prefix(1);
+    return true;
+}
+
+} // namespace
+
+bool parsePrimerRegionLine(std::string_view line, PrimerInfo& info) {
+    // Same as searching for `pos:(\d+)\tlength:(\d+)\t\+:(\d)\t-:(\d)` anywhere in the line
+    constexpr std::string_view marker = "pos:";
+    for (size_t start = line.find(marker); start != std::string_view::npos; start = line.find(marker, start + 1)) {
+        std::string_view s = line.substr(start + marker.size());
+        if (consumeInt(s, info.pos) &&
+            consume(s, "\tlength:") && consumeInt(s, info.len) &&
+            consume(s, "\t+:") && consumeDigit(s, info.plus) &&
+            consume(s, "\t-:") && consumeDigit(s, info.minus))
+            return true;
+    }
+    return false;
+}
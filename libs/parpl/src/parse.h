@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string_view>
+
+struct PrimerInfo {
+    int pos;
+    int len;
+    int plus;
+    int minus;
+};
+
+// Parses a line of a single region primer file, e.g. `pos:12\tlength:20\t+:1\t-:0`. Does not allocate.
+bool parsePrimerRegionLine(std::string_view line, PrimerInfo& info);
@@ -0,0 +1,36 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(unsigned numThreads) : m_size(numThreads > 0 ? numThreads : 1) {
+    if (m_size == 1)
+        return;
+
+    m_threads.reserve(m_size);
+    for (unsigned i = 0; i < m_size; i++)
+        m_threads.emplace_back([this] { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+
+    for (std::thread& thread : m_threads)
+        thread.join();
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+            if (m_tasks.empty())
+                return; // stopping, and nothing left to do
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed-size pool of worker threads.
+//
+// A pool of size 1 does not start any threads and runs tasks inline on the submitting thread, so single-threaded
+// builds (e.g. Emscripten without pthreads) never touch std::thread.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned numThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return m_size; }
+
+    template <typename Fn>
+    std::future<std::invoke_result_t<Fn>> submit(Fn fn);
+
+private:
+    void workerLoop();
+
+private:
+    unsigned m_size = 1;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stopping = false;
+};
+
+template <typename Fn>
+std::future<std::invoke_result_t<Fn>> ThreadPool::submit(Fn fn) {
+    using Result = std::invoke_result_t<Fn>;
+
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+    std::future<Result> future = task->get_future();
+
+    if (m_threads.empty()) {
+        (*task)();
+        return future;
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_tasks.emplace_back([task] { (*task)(); });
+    }
+    m_cv.notify_one();
+
+    return future;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Resource usage of the process at one point in time
+struct ResourceUsage {
+    std::chrono::steady_clock::time_point wallTime;
+    double cpuSeconds = 0; // user and system time of this process and of its finished child processes
+    uint64_t peakMemoryBytes = 0; // peak RSS since the process started, or the size of the WASM heap under Emscripten
+    uint64_t bytesRead = 0; // 0 where unavailable
+    uint64_t bytesWritten = 0;
+};
+
+// Resource usage of a finished child process. Its CPU time is already part of ResourceUsage::cpuSeconds once it has
+// been waited for, but its memory and I/O are not.
+struct ChildProcessUsage {
+    uint64_t peakMemoryBytes = 0; // peak RSS
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+};
+
+ResourceUsage getResourceUsage();
+
+// Reads the I/O counters of another process, e.g. of a child that has exited but was not waited for yet. Leaves them
+// unchanged where unavailable.
+void readProcessIo(int pid, uint64_t& bytesRead, uint64_t& bytesWritten);
+
+// Tracing is off by default, so TraceScopes cost next to nothing unless it is enabled
+void setTracingEnabled(bool enabled);
+bool isTracingEnabled();
+
+// Writes all finished TraceScopes as Chrome trace-event JSON, which chrome://tracing and Perfetto can load
+void writeTrace(const std::string& path);
+
+// Drops the finished TraceScopes, so a process running several jobs can write a trace per job
+void clearTrace();
+
+// Records a span from construction to destruction, with the resources used in between
+class TraceScope {
+public:
+    explicit TraceScope(std::string name, const char* category = "glapd");
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    double getElapsedSeconds() const;
+
+    // Adds a child process that ran during the span, e.g. one started and waited for inside it
+    void addChildProcessUsage(const ChildProcessUsage& usage);
+
+private:
+    std::string m_name;
+    const char* m_category;
+    bool m_enabled;
+    ResourceUsage m_begin;
+    size_t m_numChildProcesses = 0;
+    ChildProcessUsage m_childProcesses; // peak of all of them, sums of their I/O
+};
@@ -0,0 +1,209 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#if EMSCRIPTEN
+#include <emscripten/heap.h>
+#endif
+
+#include <sys/resource.h>
+
+namespace {
+
+struct TraceEvent {
+    std::string name;
+    const char* category;
+    size_t threadId;
+    ResourceUsage begin;
+    ResourceUsage end;
+    size_t numChildProcesses;
+    ChildProcessUsage childProcesses;
+};
+
+std::atomic<bool> s_enabled = false;
+std::mutex s_mutex;
+std::vector<TraceEvent> s_events;
+const std::chrono::steady_clock::time_point s_startTime = std::chrono::steady_clock::now();
+
+// Small sequential ids read better in trace viewers than hashes of std::thread::id
+std::atomic<size_t> s_nextThreadId = 1;
+thread_local const size_t t_threadId = s_nextThreadId++;
+
+double toSeconds(const timeval& t) {
+    return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+#if !EMSCRIPTEN
+// rchar and wchar of /proc/<pid>/io, i.e. including reads served from the page cache
+void readProcIo(const std::string& path, uint64_t& bytesRead, uint64_t& bytesWritten) {
+    std::FILE* file = std::fopen(path.c_str(), "r");
+    if (!file)
+        return;
+
+    char key[64];
+    unsigned long long value;
+    while (std::fscanf(file, "%63s %llu", key, &value) == 2) {
+        if (std::string_view(key) == "rchar:")
+            bytesRead = value;
+        else if (std::string_view(key) == "wchar:")
+            bytesWritten = value;
+    }
+    std::fclose(file);
+}
+#endif
+
+void appendJsonString(std::string& out, std::string_view s) {
+    out += '"';
+    for (const char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+double toMicroseconds(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(t - s_startTime).count();
+}
+
+} // namespace
+
+ResourceUsage getResourceUsage() {
+    ResourceUsage usage;
+    usage.wallTime = std::chrono::steady_clock::now();
+
+    rusage self = {};
+    getrusage(RUSAGE_SELF, &self);
+    rusage children = {};
+    getrusage(RUSAGE_CHILDREN, &children);
+    usage.cpuSeconds = toSeconds(self.ru_utime) + toSeconds(self.ru_stime)
+        + toSeconds(children.ru_utime) + toSeconds(children.ru_stime);
+
+#if EMSCRIPTEN
+    usage.peakMemoryBytes = emscripten_get_heap_size(); // the heap only grows
+#else
+    usage.peakMemoryBytes = uint64_t(self.ru_maxrss) * 1024; // KB on Linux
+    readProcIo("/proc/self/io", usage.bytesRead, usage.bytesWritten);
+#endif
+
+    return usage;
+}
+
+void readProcessIo(int pid, uint64_t& bytesRead, uint64_t& bytesWritten) {
+#if !EMSCRIPTEN
+    readProcIo("/proc/" + std::to_string(pid) + "/io", bytesRead, bytesWritten);
+#endif
+}
+
+void setTracingEnabled(bool enabled) {
+    s_enabled = enabled;
+}
+
+bool isTracingEnabled() {
+    return s_enabled;
+}
+
+void clearTrace() {
+    std::lock_guard lock(s_mutex);
+    s_events.clear();
+}
+
+void writeTrace(const std::string& path) {
+    std::string json = "{\"traceEvents\":[\n";
+
+    {
+        std::lock_guard lock(s_mutex);
+        for (size_t i = 0; i < s_events.size(); i++) {
+            const TraceEvent& event = s_events[i];
+            const double ts = toMicroseconds(event.begin.wallTime);
+            const double dur = toMicroseconds(event.end.wallTime) - ts;
+
+            json += "{\"name\":";
+            appendJsonString(json, event.name);
+            json += ",\"cat\":";
+            appendJsonString(json, event.category);
+            // The peak memory is that of the whole process up to the end of the span, not of the span alone
+            char buf[512];
+            std::snprintf(buf, sizeof(buf),
+                ",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{"
+                "\"cpuSeconds\":%.6f,\"processPeakMemoryBytes\":%llu,\"bytesRead\":%llu,\"bytesWritten\":%llu",
+                event.threadId, ts, dur,
+                event.end.cpuSeconds - event.begin.cpuSeconds,
+                static_cast<unsigned long long>(event.end.peakMemoryBytes),
+                static_cast<unsigned long long>(event.end.bytesRead - event.begin.bytesRead),
+                static_cast<unsigned long long>(event.end.bytesWritten - event.begin.bytesWritten));
+            json += buf;
+            if (event.numChildProcesses > 0) {
+                std::snprintf(buf, sizeof(buf),
+                    ",\"childProcesses\":%zu,\"childPeakMemoryBytes\":%llu,\"childBytesRead\":%llu,\"childBytesWritten\":%llu",
+                    event.numChildProcesses,
+                    static_cast<unsigned long long>(event.childProcesses.peakMemoryBytes),
+                    static_cast<unsigned long long>(event.childProcesses.bytesRead),
+                    static_cast<unsigned long long>(event.childProcesses.bytesWritten));
+                json += buf;
+            }
+            json += i + 1 < s_events.size() ? "}},\n" : "}}\n";
+        }
+    }
+
+    json += "],\"displayTimeUnit\":\"ms\"}\n";
+
+    std::ofstream out(path);
+    if (!out)
+        throw std::runtime_error("Cannot open file: " + path);
+    out << json;
+}
+
+TraceScope::TraceScope(std::string name, const char* category)
+    : m_name(std::move(name))
+    , m_category(category)
+    , m_enabled(s_enabled)
+{
+    if (m_enabled)
+        m_begin = getResourceUsage();
+    else
+        m_begin.wallTime = std::chrono::steady_clock::now();
+}
+
+TraceScope::~TraceScope() {
+    if (!m_enabled)
+        return;
+
+    TraceEvent event {
+        .name = std::move(m_name),
+        .category = m_category,
+        .threadId = t_threadId,
+        .begin = m_begin,
+        .end = getResourceUsage(),
+        .numChildProcesses = m_numChildProcesses,
+        .childProcesses = m_childProcesses,
+    };
+
+    std::lock_guard lock(s_mutex);
+    s_events.push_back(std::move(event));
+}
+
+void TraceScope::addChildProcessUsage(const ChildProcessUsage& usage) {
+    m_numChildProcesses++;
+    m_childProcesses.peakMemoryBytes = std::max(m_childProcesses.peakMemoryBytes, usage.peakMemoryBytes);
+    m_childProcesses.bytesRead += usage.bytesRead;
+    m_childProcesses.bytesWritten += usage.bytesWritten;
+}
+
+double TraceScope::getElapsedSeconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_begin.wallTime).count();
+}
@@ -20,6 +20,8 @@ let resultsAreaElement;
 let resultsElement;
 let saveResultsBtn;
 let saveWorkspaceBtn;
+let saveTraceBtn;
+let changeParametersBtn;
 
 let parametersPageElement;
 let progressPageElement;
@@ -28,12 +30,35 @@ let progressPageElement;
 
 let log;
 let primers;
-let workspaceZip;
+let workspaceWriter; // receives the chunks of the workspace while it is being saved
+let trace; // Chrome trace-event JSON of the last run
 
 function resetOutput() {
     log = "";
     primers = [];
-    workspaceZip = null;
+    trace = null;
+    for (const el of document.getElementsByClassName('phaseDuration'))
+        el.innerText = '';
+    lampSetsElement.innerText = '';
+    lampSetsElement.style.display = 'none';
+    resultsAreaElement.style.display = 'none';
+    changeParametersBtn.style.display = 'none';
+    setProgressTitle('Please Wait');
+}
+
+function setProgressTitle(title) {
+    const h2Element = progressPageElement.getElementsByTagName('h2')[0];
+    if (h2Element)
+        h2Element.innerText = title;
+}
+
+// Ends a run. The worker keeps the module loaded, so the next run starts right away.
+function finishRun(title) {
+    setProgressTitle(title);
+    setActivePhase('');
+    clearProgressDetails();
+    changeParametersBtn.style.display = '';
+    window.removeEventListener("beforeunload", beforeUnloadHandler);
 }
 
 function logLine(msg) {
@@ -126,13 +151,21 @@ function clearProgressDetails() {
         el.innerText = '';
 }
 
+function setPhaseDuration(phase, seconds) {
+    const element = document.getElementById(phase);
+    if (!element)
+        return;
+
+    const durationElement = element.getElementsByClassName('phaseDuration')[0];
+    durationElement.innerText = `${seconds.toFixed(1)} s`;
+}
+
 function setActivePhase(phase) {
     const phaseElements = [
         document.getElementById('buildBowtieIndex'),
         document.getElementById('generateSingleRegionPrimers'),
         document.getElementById('alignSingleRegionPrimers'),
         document.getElementById('generateLampPrimerSets'),
-        document.getElementById('createWorkspaceZip'),
     ];
 
     var found = false;
@@ -213,6 +246,49 @@ async function saveFile(filename, content) {
         saveFileUsingLink(filename, content);
 }
 
+// Returns an object with write(chunk) and close(ok), or null if the user cancelled
+async function createChunkedFileWriter(filename) {
+    if (!window.showSaveFilePicker) {
+        // Blobs can be made of many parts, so the chunks are not copied into one buffer
+        const chunks = [];
+        return {
+            write: (chunk) => chunks.push(chunk),
+            close: (ok) => {
+                if (ok)
+                    saveFileUsingLink(filename, new Blob(chunks, { type: 'application/zip' }));
+            },
+        };
+    }
+
+    let writable;
+    try {
+        const handle = await window.showSaveFilePicker({
+            suggestedName: filename,
+            types: [{
+                description: 'Zip Archives',
+                accept: { 'application/zip': ['.zip'] },
+            }],
+        });
+        writable = await handle.createWritable();
+    } catch (err) {
+        console.error("Save cancelled or failed:", err);
+        return null;
+    }
+
+    // Messages arrive faster than they are written, so writes are chained to keep their order
+    let pending = Promise.resolve();
+    return {
+        write: (chunk) => {
+            pending = pending.then(() => writable.write(chunk));
+        },
+        close: (ok) => {
+            pending = pending
+                .then(() => ok ? writable.close() : writable.abort())
+                .catch((err) => console.error("Save failed:", err));
+        },
+    };
+}
+
 // Init
 
 function getElementById(name) {
@@ -241,6 +317,8 @@ function initHTMLElements() {
     resultsElement = getElementById('results');
     saveResultsBtn = getElementById('saveResultsBtn');
     saveWorkspaceBtn = getElementById('saveWorkspaceBtn');
+    saveTraceBtn = getElementById('saveTraceBtn');
+    changeParametersBtn = getElementById('changeParametersBtn');
 
     parametersPageElement = getElementById('parametersPage');
     progressPageElement = getElementById('progressPage');
@@ -285,19 +363,26 @@ function init() {
         if (cmd == 'print' || cmd == 'printErr') {
             logLine(msg.text);
         } else if (cmd == 'results') {
-            workspaceZip = msg.args.workspaceZip;
+            trace = msg.args.trace;
+            saveTraceBtn.style.display = trace ? '' : 'none';
             resultsAreaElement.style.display = 'block';
             resultsElement.innerText = msg.args.results;
-            const h2Element = progressPageElement.getElementsByTagName('h2')[0];
-            if (h2Element)
-                h2Element.innerText = 'Done';
-            setActivePhase('');
-            clearProgressDetails();
-            window.removeEventListener("beforeunload", beforeUnloadHandler);
+            finishRun('Done');
+        } else if (cmd == 'failed') {
+            finishRun('Failed, see the log for details');
+        } else if (cmd == 'workspaceChunk') {
+            workspaceWriter.write(msg.chunk);
+        } else if (cmd == 'workspaceEnd') {
+            workspaceWriter.close(msg.ok);
+            workspaceWriter = null;
+            saveWorkspaceBtn.disabled = false;
         } else if (cmd == 'notify_about_to_start_phase') {
             const { phase } = msg;
             setActivePhase(phase);
             clearProgressDetails();
+        } else if (cmd == 'notify_finished_phase') {
+            const { phase, seconds } = msg;
+            setPhaseDuration(phase, seconds);
         } else if (cmd == 'notify_about_to_check_candidate_primer_region') {
             const { current, total } = msg;
             const percentage = current / total * 100;
@@ -329,26 +414,27 @@ function init() {
 
     numPrimersToGenerateElement.addEventListener('input', () => validateNumberOfPrimersToGenerateInput(numPrimersToGenerateElement));
 
-    async function runGlapd() {
+    function runGlapd() {
         if (!validateInputs())
             return;
 
         resetOutput();
 
+        // Files are posted as they are. The worker reads them in place, which keeps large indexes out of memory.
         const args = {
-            index: await indexFileElement.files[0].text(),
-            ref: await refFileElement.files[0].text(),
-            targetList: await targetListFileElement.files[0].text(),
+            index: indexFileElement.files[0],
+            ref: refFileElement.files[0],
+            targetList: targetListFileElement.files[0],
             maxNumMismatchesInTarget: maxNumMismatchesInTargetElement.value,
             backgroundMode: backgroundModeElement.value,
-            backgroundList: backgroundModeElement.value == 'fromFile' ? await backgroundListFileElement.files[0].text() : null,
+            backgroundList: backgroundModeElement.value == 'fromFile' ? backgroundListFileElement.files[0] : null,
             maxNumMismatchesInBackground: maxNumMismatchesInBackgroundElement.value,
             includeLoopPrimers: includeLoopPrimersElement.checked,
             numPrimersToGenerate: numPrimersToGenerateElement.value,
         };
 
         // Dispatch to worker
-        worker.postMessage(args);
+        worker.postMessage({ cmd: 'run', args });
 
         // Update HTML
         window.addEventListener("beforeunload", beforeUnloadHandler);
@@ -361,13 +447,33 @@ function init() {
 
     runBtn.addEventListener('click', () => runGlapd());
 
+    changeParametersBtn.addEventListener('click', () => {
+        progressPageElement.style.display = 'none';
+        parametersPageElement.style.display = '';
+        runBtn.disabled = false;
+    });
+
     toggleLogBtn.addEventListener('click', () => toggleLog());
 
     backgroundModeElement.addEventListener('change', () => updateBackgroundListFileLabelVisibility());
 
     saveResultsBtn.addEventListener('click', () => saveFile('glapdx.txt', resultsElement.innerText));
 
-    saveWorkspaceBtn.addEventListener('click', () => saveFile('glapdx_workspace.zip', workspaceZip));
+    async function saveWorkspace() {
+        // The workspace is only archived when asked for, and streamed into the file
+        saveWorkspaceBtn.disabled = true;
+        workspaceWriter = await createChunkedFileWriter('glapdx_workspace.zip');
+        if (!workspaceWriter) {
+            saveWorkspaceBtn.disabled = false;
+            return;
+        }
+        worker.postMessage({ cmd: 'createWorkspace' });
+    }
+
+    saveWorkspaceBtn.addEventListener('click', () => saveWorkspace());
+
+    // Can be loaded into chrome://tracing or https://ui.perfetto.dev
+    saveTraceBtn.addEventListener('click', () => saveFile('glapdx_trace.json', trace));
 }
 
 if (document.readyState === "loading") {
@@ -1,5 +1,7 @@
 var Module = {
     'noInitialRun': true,
+    // pthread workers have to load the Emscripten output, not this file
+    'mainScriptUrlOrBlob': 'portable-glapd.js',
 };
 
 Module.print = (text) => {
@@ -16,35 +18,221 @@ Module.printErr = (text) => {
     });
 }
 
+// Bowtie indexes are cached in IndexedDB, so returning users skip building them. Only the entry of the current index
+// FASTA is held in /cache: the files of every entry are stored as one record, and their sizes and last use separately,
+// so neither looking up nor evicting an entry reads the others.
+//
+// The worker alone evicts entries, in storeIndexCacheEntry. portable-glapd's own eviction is for native runs and is
+// turned off with --indexCacheSizeLimitMB 0.
+const indexCacheDir = '/cache';
+const indexCacheSizeLimitMB = 1024;
+const indexCacheDbName = 'glapd-index-cache';
+
+let indexCacheDb = null;
+let pendingIndexCacheStore = Promise.resolve();
+
+function requestToPromise(request) {
+    return new Promise((resolve, reject) => {
+        request.onsuccess = () => resolve(request.result);
+        request.onerror = () => reject(request.error);
+    });
+}
+
+function transactionToPromise(transaction) {
+    return new Promise((resolve, reject) => {
+        transaction.oncomplete = () => resolve();
+        transaction.onerror = transaction.onabort = () => reject(transaction.error);
+    });
+}
+
+async function openIndexCacheDb() {
+    if (!indexCacheDb) {
+        const request = indexedDB.open(indexCacheDbName, 1);
+        request.onupgradeneeded = () => {
+            request.result.createObjectStore('entries'); // key -> { size, lastUsed }
+            request.result.createObjectStore('files'); // key -> { fileName: Uint8Array }
+        };
+        indexCacheDb = await requestToPromise(request);
+    }
+    return indexCacheDb;
+}
+
+// Puts the entry for key into /cache, if IndexedDB has it, and drops the other entries from memory. Returns whether
+// it was found.
+async function loadIndexCacheEntry(key) {
+    await pendingIndexCacheStore;
+
+    for (const name of FS.readdir(indexCacheDir)) {
+        if (name !== '.' && name !== '..' && name !== key)
+            removeTree(indexCacheDir + '/' + name);
+    }
+
+    const entryDir = indexCacheDir + '/' + key;
+    if (FS.analyzePath(entryDir).exists)
+        return true; // built by an earlier job
+
+    try {
+        const db = await openIndexCacheDb();
+        const transaction = db.transaction(['entries', 'files'], 'readwrite');
+        const done = transactionToPromise(transaction);
+        const [entry, files] = await Promise.all([
+            requestToPromise(transaction.objectStore('entries').get(key)),
+            requestToPromise(transaction.objectStore('files').get(key)),
+        ]);
+        if (!entry || !files) {
+            await done;
+            return false;
+        }
+        entry.lastUsed = Date.now();
+        transaction.objectStore('entries').put(entry, key);
+        await done;
+
+        FS.mkdirTree(entryDir);
+        for (const [fileName, data] of Object.entries(files))
+            FS.writeFile(entryDir + '/' + fileName, data);
+        return true;
+    } catch (err) {
+        console.error('Could not load index cache:', err);
+        return false;
+    }
+}
+
+// Stores the entry for key that the run just built, then evicts the least recently used entries beyond the limit
+async function storeIndexCacheEntry(key) {
+    const entryDir = indexCacheDir + '/' + key;
+    if (!FS.analyzePath(entryDir).exists)
+        return; // built without the cache
+
+    const files = {};
+    let size = 0;
+    for (const fileName of FS.readdir(entryDir)) {
+        if (fileName === '.' || fileName === '..')
+            continue;
+        files[fileName] = FS.readFile(entryDir + '/' + fileName);
+        size += files[fileName].length;
+    }
+
+    try {
+        const db = await openIndexCacheDb();
+        const transaction = db.transaction(['entries', 'files'], 'readwrite');
+        const done = transactionToPromise(transaction);
+        const entriesStore = transaction.objectStore('entries');
+        const filesStore = transaction.objectStore('files');
+        entriesStore.put({ size, lastUsed: Date.now() }, key);
+        filesStore.put(files, key);
+
+        const [keys, entries] = await Promise.all([
+            requestToPromise(entriesStore.getAllKeys()),
+            requestToPromise(entriesStore.getAll()),
+        ]);
+        const others = keys.map((k, i) => ({ key: k, ...entries[i] })).filter((e) => e.key !== key);
+        others.sort((a, b) => a.lastUsed - b.lastUsed);
+        let totalSize = entries.reduce((sum, e) => sum + e.size, 0);
+        for (const other of others) {
+            if (totalSize <= indexCacheSizeLimitMB * 1024 * 1024)
+                break;
+            entriesStore.delete(other.key);
+            filesStore.delete(other.key);
+            totalSize -= other.size;
+        }
+        await done;
+    } catch (err) {
+        console.error('Could not store index cache:', err);
+    }
+}
+
+// The module stays loaded between jobs. Each job gets its own directory for its inputs and trace, which is kept until
+// the next job starts, since saving the workspace reads the inputs again. The inputs are the user's File objects,
+// mounted with WORKERFS, so they are read from disk as needed instead of being copied into memory.
+const jobsDir = '/jobs';
+let numJobs = 0;
+let lastJobDir = null;
+
+function removeTree(path) {
+    for (const name of FS.readdir(path)) {
+        if (name === '.' || name === '..')
+            continue;
+        const childPath = path + '/' + name;
+        if (FS.isDir(FS.stat(childPath).mode))
+            removeTree(childPath);
+        else
+            FS.unlink(childPath);
+    }
+    FS.rmdir(path);
+}
+
+// The workspace reaches the main thread in workspaceChunk messages while it is archived, see notify_workspace_chunk
+function createWorkspace() {
+    const ok = Module._create_workspace_zip() === 0;
+    postMessage({ 'cmd': 'workspaceEnd', 'ok': ok });
+}
+
 Module.onRuntimeInitialized = () => {
-    self.onmessage = (e) => {
-        const msg = e.data;
+    FS.mkdir(indexCacheDir);
 
-        FS.mkdir('inputs')
-        FS.writeFile('inputs/index.fa', msg.index);
-        FS.writeFile('inputs/ref.fa',msg.ref);
-        FS.writeFile('inputs/target.fa', msg.targetList);
+    self.onmessage = async (e) => {
+        if (e.data.cmd == 'createWorkspace') {
+            createWorkspace();
+            return;
+        }
+
+        const msg = e.data.args;
+
+        if (lastJobDir) {
+            FS.unmount(lastJobDir + '/inputs');
+            removeTree(lastJobDir);
+        }
+        const jobDir = `${jobsDir}/${numJobs++}`;
+        lastJobDir = jobDir;
+
+        const inputs = [
+            { name: 'index.fa', data: msg.index },
+            { name: 'ref.fa', data: msg.ref },
+            { name: 'target.fa', data: msg.targetList },
+        ];
         if (msg.backgroundMode == 'fromFile')
-            FS.writeFile('inputs/background.fa', msg.backgroundList);
+            inputs.push({ name: 'background.fa', data: msg.backgroundList });
+
+        FS.mkdirTree(jobDir + '/inputs');
+        FS.mount(WORKERFS, { blobs: inputs }, jobDir + '/inputs');
+
+        // Also hashed for the phase memo, so the run reuses the digest
+        const indexKey = ccall('compute_index_digest', 'string', ['string'], [jobDir + '/inputs/index.fa']);
+        const isIndexCached = indexKey !== '' && await loadIndexCacheEntry(indexKey);
 
         const args = [
-            '--index', 'inputs/index.fa',
-            '--ref', 'inputs/ref.fa',
-            '--target', 'inputs/target.fa',
+            '--index', jobDir + '/inputs/index.fa',
+            '--ref', jobDir + '/inputs/ref.fa',
+            '--target', jobDir + '/inputs/target.fa',
             '--maxNumMismatchesInTarget', msg.maxNumMismatchesInTarget,
             '--backgroundMode', msg.backgroundMode,
             // --backgroundListPath is handled below
             '--maxNumMismatchesInBackground', msg.maxNumMismatchesInBackground,
             // --includeLoopPrimers is handled below
             '--numPrimersToGenerate', msg.numPrimersToGenerate,
-            '--numThreads', '1', // TODO fix pthreads, then use: String(navigator.hardwareConcurrency),
+            '--numThreads', String(navigator.hardwareConcurrency),
+            '--indexCacheDir', indexCacheDir,
+            '--indexCacheSizeLimitMB', '0', // evicted by storeIndexCacheEntry
+            // Created when the user saves the workspace
+            '--deferWorkspace',
+            '--trace', jobDir + '/trace.json',
         ];
         if (msg.backgroundMode == 'fromFile')
-            args.push('--backgroundListPath', 'inputs/background.fa');
+            args.push('--backgroundListPath', jobDir + '/inputs/background.fa');
         if (msg.includeLoopPrimers)
             args.push('--includeLoopPrimers');
 
-        const exitCode = callMain(args);
+        // Errors end up in main()'s catch blocks, but an abort still escapes as a JS exception
+        let exitCode;
+        try {
+            exitCode = callMain(args);
+        } catch (err) {
+            console.error(err);
+            exitCode = 1;
+        }
+
+        if (indexKey !== '' && !isIndexCached)
+            pendingIndexCacheStore = storeIndexCacheEntry(indexKey);
 
         const tryRead = (path, encoding) => {
             try {
@@ -56,14 +244,16 @@ Module.onRuntimeInitialized = () => {
 
         if (exitCode === 0) {
             const results = tryRead('success.txt', 'utf8');
-            const workspaceZip = tryRead('workspace.zip', 'binary');
+            const trace = tryRead(jobDir + '/trace.json', 'utf8');
             postMessage({
                 'cmd': 'results',
                 'args': {
                     results,
-                    workspaceZip,
+                    trace,
                 },
             });
+        } else {
+            postMessage({ 'cmd': 'failed' });
         }
     };
 };
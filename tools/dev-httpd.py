@@ -41,6 +41,7 @@ class Handler(http.server.BaseHTTPRequestHandler):
 
         self.send_response(200)
         self.send_header('Content-Type', content_type)
+        self.send_cross_origin_isolation_headers()
         self.end_headers()
 
         # Send body
@@ -48,6 +49,11 @@ class Handler(http.server.BaseHTTPRequestHandler):
         with open(path, 'rb') as f:
             self.wfile.write(f.read())
 
+    def send_cross_origin_isolation_headers(self):
+        # Required for SharedArrayBuffer, which the pthreads build needs
+        self.send_header('Cross-Origin-Opener-Policy', 'same-origin')
+        self.send_header('Cross-Origin-Embedder-Policy', 'require-corp')
+
     def send_404(self):
         self.send_error(404)
 